@@ -0,0 +1,115 @@
+#!/usr/bin/env bash
+#
+# pg_repack: bench/catalog.sh
+#
+# Build a database with a large catalog -- many schemas, tables, indexes and
+# partition trees, as found on multi-tenant clusters -- and time the catalog
+# queries pg_repack runs before touching any data: the repack.tables query
+# of repack_one_database(), the per-table index query of repack_one_table(),
+# a whole-database --dry-run and the --only-indexes discovery of partition
+# trees.
+#
+# Generating the catalog takes a while; it is kept between runs unless
+# BENCH_REGENERATE=1 is given.
+#
+
+set -e
+. "$(dirname "$0")/common.sh"
+
+PGDATABASE=${BENCH_CATALOG_DB:-repack_bench_catalog}
+: ${BENCH_SCHEMAS:=100}			# schemas the tables are spread over
+: ${BENCH_TABLES:=100000}		# tables, partitions included
+: ${BENCH_INDEXES:=5}			# indexes per table, primary key included
+: ${BENCH_TREES:=1000}			# partitioned tables
+: ${BENCH_PARTITIONS:=10}		# partitions of each partitioned table
+: ${BENCH_SAMPLE:=100}			# tables sampled for the per-table queries
+: ${BENCH_REGENERATE:=0}
+
+out=$BENCH_OUT/catalog
+rm -rf "$out"
+mkdir -p "$out"
+
+plain=$((BENCH_TABLES - BENCH_TREES * BENCH_PARTITIONS))
+if [ $plain -lt 0 ]; then
+	echo "BENCH_TREES * BENCH_PARTITIONS exceeds BENCH_TABLES" >&2
+	exit 1
+fi
+# the columns the secondary indexes are built on
+columns="(ARRAY['a', 'b', 'c', 'd', 'a, b', 'b, c', 'c, d', 'a, d'])[1:$((BENCH_INDEXES - 1))]"
+
+if [ "$BENCH_REGENERATE" != 0 ]; then
+	dropdb --if-exists "$PGDATABASE"
+fi
+
+if ! sql "SELECT 1 FROM pg_class WHERE relname = 'catalog_generated'" 2>/dev/null | grep -q 1; then
+	setup_db
+	echo "generating $BENCH_TABLES tables in $PGDATABASE..." >&2
+	$PSQL <<SQL
+SELECT format('CREATE SCHEMA IF NOT EXISTS tenant_%s', s)
+  FROM generate_series(1, $BENCH_SCHEMAS) s
+\gexec
+
+SELECT format('CREATE TABLE tenant_%s.t_%s (id integer PRIMARY KEY, a integer, b integer, c text, d timestamptz)',
+			  i % $BENCH_SCHEMAS + 1, i)
+  FROM generate_series(1, $plain) i
+\gexec
+
+SELECT format('CREATE INDEX ON tenant_%s.t_%s (%s)', i % $BENCH_SCHEMAS + 1, i, col)
+  FROM generate_series(1, $plain) i, unnest($columns) col
+\gexec
+
+SELECT format('CREATE TABLE tenant_%s.p_%s (id integer PRIMARY KEY, a integer, b integer, c text, d timestamptz) PARTITION BY RANGE (id)',
+			  i % $BENCH_SCHEMAS + 1, i)
+  FROM generate_series(1, $BENCH_TREES) i
+\gexec
+
+SELECT format('CREATE INDEX ON tenant_%s.p_%s (%s)', i % $BENCH_SCHEMAS + 1, i, col)
+  FROM generate_series(1, $BENCH_TREES) i, unnest($columns) col
+\gexec
+
+SELECT format('CREATE TABLE tenant_%s.p_%s_%s PARTITION OF tenant_%s.p_%s FOR VALUES FROM (%s) TO (%s)',
+			  i % $BENCH_SCHEMAS + 1, i, j, i % $BENCH_SCHEMAS + 1, i, j * 1000, (j + 1) * 1000)
+  FROM generate_series(1, $BENCH_TREES) i, generate_series(1, $BENCH_PARTITIONS) j
+\gexec
+
+CREATE TABLE catalog_generated (id integer PRIMARY KEY);
+VACUUM ANALYZE;
+SQL
+fi
+
+# run the command given as arguments, discarding its output, and print how
+# many seconds it took
+elapsed()
+{
+	local start=$(now)
+	"$@" > /dev/null 2>> "$out/errors.txt" || true
+	echo "$start $(now)" | awk '{ printf "%.3f", $2 - $1 }'
+}
+
+tables_query="SELECT t.*, coalesce(v.tablespace, t.tablespace_orig) AS tablespace_dest
+  FROM repack.tables t, (VALUES (NULL::text)) AS v (tablespace)
+ WHERE pkid IS NOT NULL ORDER BY t.relname, t.schemaname"
+
+# the same query as repack_one_table() runs for each table, for a sample of
+# the tables
+sample=$(sql "SELECT string_agg(oid::text, ' ') FROM (SELECT c.oid FROM pg_class c
+	JOIN pg_namespace n ON n.oid = c.relnamespace
+	WHERE n.nspname LIKE 'tenant\_%' AND c.relkind = 'r'
+	ORDER BY random() LIMIT $BENCH_SAMPLE) s")
+for relid in $sample; do
+	echo "SELECT indexrelid, repack.repack_indexdef(indexrelid, indrelid, NULL, FALSE)
+	  FROM pg_index WHERE indrelid = $relid AND indisvalid;"
+done > "$out/index_queries.sql"
+
+tables_secs=$(elapsed sql "$tables_query")
+index_secs=$(elapsed $PSQL -f "$out/index_queries.sql")
+dryrun_secs=$(elapsed $PG_REPACK --dbname="$PGDATABASE" --dry-run)
+schema_secs=$(elapsed $PG_REPACK --dbname="$PGDATABASE" --dry-run --schema=tenant_1)
+tree=$(sql "SELECT c.oid::regclass FROM pg_class c WHERE c.relkind = 'p' LIMIT 1")
+only_indexes_secs=$(elapsed $PG_REPACK --dbname="$PGDATABASE" --dry-run --only-indexes --parent-table="$tree")
+
+read tables indexes <<< "$(sql "SELECT count(*) FILTER (WHERE relkind = 'r'), count(*) FILTER (WHERE relkind = 'i') FROM pg_class")"
+cat > "$out/summary.json" <<JSON
+{"benchmark": "catalog", "tables": $tables, "indexes": $indexes, "tables_query_sec": $tables_secs, "index_query_avg_sec": $(echo "$index_secs $BENCH_SAMPLE" | awk '{ printf "%.6f", $1 / $2 }'), "dry_run_sec": $dryrun_secs, "dry_run_schema_sec": $schema_secs, "only_indexes_tree_sec": $only_indexes_secs}
+JSON
+cat "$out/summary.json"
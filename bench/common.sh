@@ -0,0 +1,100 @@
+#
+# pg_repack: bench/common.sh
+#
+# Helpers shared by the benchmark scripts. The server is selected with the
+# usual libpq environment variables (PGHOST, PGPORT, PGUSER); the benchmarks
+# run in their own database, $PGDATABASE, which is created if needed.
+#
+
+: ${PGDATABASE:=repack_bench}
+export PGDATABASE
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+: ${BENCH_OUT:=$BENCH_DIR/output}
+: ${PG_REPACK:=pg_repack}
+
+PSQL="psql -X -q -v ON_ERROR_STOP=1"
+
+# current time, in seconds since the epoch
+now()
+{
+	date +%s.%N
+}
+
+# run a query and print its result, one row per line, columns separated by
+# a space
+sql()
+{
+	$PSQL -At -F ' ' -c "$1"
+}
+
+# create the benchmark database and install pg_repack in it
+setup_db()
+{
+	createdb "$PGDATABASE" 2>/dev/null || true
+	sql "CREATE EXTENSION IF NOT EXISTS pg_repack" >/dev/null
+}
+
+# print the P-th percentile of the numbers read on stdin, one per line
+percentile()
+{
+	sort -n | awk -v p="$1" '
+		{ v[NR] = $1 }
+		END {
+			if (NR == 0) { print 0; exit }
+			i = int((NR * p + 99) / 100)
+			print v[i < 1 ? 1 : i]
+		}'
+}
+
+# print the maximum of the numbers read on stdin, one per line
+maximum()
+{
+	awk 'NR == 1 || $1 > m { m = $1 } END { print m + 0 }'
+}
+
+# sample, once per second until killed, the size of the pg_repack log tables
+# and the number of backends waiting on a lock; one line per sample is
+# appended to the file given as argument: "epoch log_bytes lock_waiters"
+monitor()
+{
+	while sql "SELECT extract(epoch FROM clock_timestamp()),
+		coalesce((SELECT sum(pg_total_relation_size(c.oid))
+			FROM pg_class c JOIN pg_namespace n ON n.oid = c.relnamespace
+			WHERE n.nspname = 'repack' AND c.relname LIKE 'log\_%'
+			AND c.relkind = 'r'), 0),
+		(SELECT count(*) FROM pg_stat_activity
+			WHERE wait_event_type = 'Lock'
+			AND datname = current_database())" >> "$1"
+	do
+		sleep 1
+	done
+}
+
+# prefix each line read on stdin with the time it was read at
+timestamp_lines()
+{
+	while IFS= read -r line
+	do
+		printf '%s %s\n' "$(now)" "$line"
+	done
+}
+
+# latencies in milliseconds, from the pgbench per-transaction logs whose
+# prefix is given as argument. With two more arguments, only keep the
+# transactions that completed between these two epochs.
+pgbench_latencies()
+{
+	cat "$1".* | awk -v from="${2:-0}" -v to="${3:-0}" '
+		{
+			done = $5 + $6 / 1000000
+			if (to == 0 || (done >= from && done <= to))
+				print $3 / 1000
+		}'
+}
+
+# transactions per second reported by pgbench in the file given as argument
+pgbench_tps()
+{
+	awk '/^tps = / { print $3; exit }' "$1"
+}
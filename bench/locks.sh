@@ -0,0 +1,119 @@
+#!/usr/bin/env bash
+#
+# pg_repack: bench/locks.sh
+#
+# Measure how long the lock windows of pg_repack block the clients of the
+# table being repacked. Many pgbench clients run short reads and writes and
+# a few sessions run long queries on the table while pg_repack repacks it;
+# the timestamped DEBUG2 output of pg_repack delimits the windows:
+#
+#   setup	the exclusive lock taken to create the trigger and the log table
+#   handoff	the ACCESS SHARE lock requested by conn2 before setup commits
+#   swap	the exclusive lock taken to apply the last changes and swap
+#   drop	the exclusive lock taken to drop the temporary objects
+#
+# For each window the number, maximum and p99 latency of the transactions
+# running during the window are reported.
+#
+
+set -e
+. "$(dirname "$0")/common.sh"
+
+: ${BENCH_ROWS:=200000}			# rows in the table
+: ${BENCH_CLIENTS:=32}			# pgbench clients
+: ${BENCH_DURATION:=60}			# seconds of pgbench load
+: ${BENCH_WRITE_PCT:=20}		# percentage of write transactions
+: ${BENCH_LONG_QUERIES:=2}		# sessions running long queries
+: ${BENCH_LONG_SECS:=5}			# duration of each long query
+: ${REPACK_OPTS:=}				# extra options given to pg_repack
+
+out=$BENCH_OUT/locks
+rm -rf "$out"
+mkdir -p "$out"
+
+setup_db
+$PSQL <<SQL
+DROP TABLE IF EXISTS bench_lock;
+CREATE TABLE bench_lock (id bigint PRIMARY KEY, n integer NOT NULL DEFAULT 0, pad text);
+INSERT INTO bench_lock SELECT i, 0, md5(i::text) FROM generate_series(1, $BENCH_ROWS) i;
+UPDATE bench_lock SET n = 1 WHERE id % 4 = 0;
+VACUUM ANALYZE bench_lock;
+SQL
+
+pick="\\set id random(1, $BENCH_ROWS)"
+printf '%s\nSELECT n FROM bench_lock WHERE id = :id;\n' "$pick" > "$out/read.sql"
+printf '%s\nUPDATE bench_lock SET n = n + 1 WHERE id = :id;\n' "$pick" > "$out/write.sql"
+
+pgbench -n -c "$BENCH_CLIENTS" -j 4 -T "$BENCH_DURATION" \
+	-l --log-prefix="$out/txn" \
+	-f "$out/read.sql@$((100 - BENCH_WRITE_PCT))" \
+	-f "$out/write.sql@$BENCH_WRITE_PCT" > "$out/pgbench.txt" 2>&1 &
+bench_pid=$!
+
+# long-running queries, restarted until the end of the pgbench run
+end=$(($(date +%s) + BENCH_DURATION))
+long_pids=
+for i in $(seq 1 "$BENCH_LONG_QUERIES"); do
+	while [ "$(date +%s)" -lt $end ]; do
+		sql "SELECT pg_sleep($BENCH_LONG_SECS) FROM bench_lock LIMIT 1" > /dev/null 2>&1 || true
+	done &
+	long_pids="$long_pids $!"
+done
+
+sleep $((BENCH_DURATION / 6))
+$PG_REPACK --dbname="$PGDATABASE" --table=bench_lock --elevel=DEBUG2 $REPACK_OPTS 2>&1 |
+	timestamp_lines > "$out/repack.txt" ||
+	echo "pg_repack failed, see $out/repack.txt" >&2
+last=$(now)
+
+wait $bench_pid $long_pids
+
+# epoch of the first line of repack.txt containing the given text
+marker()
+{
+	awk -v text="$1" 'index($0, text) { print $1; exit }' "$out/repack.txt"
+}
+
+setup=$(marker "---- setup ----")
+handoff=$(marker "IN ACCESS SHARE MODE")
+copy=$(marker "---- copy tuples ----")
+swap=$(marker "---- swap ----")
+drop=$(marker "---- drop ----")
+analyze=$(marker "---- analyze ----")
+
+# latencies in milliseconds of the transactions running between two epochs
+blocked()
+{
+	cat "$out"/txn.* | awk -v from="$1" -v to="$2" '
+		{
+			done = $5 + $6 / 1000000
+			if (done >= from && done - $3 / 1000000 <= to)
+				print $3 / 1000
+		}'
+}
+
+window()
+{
+	if [ -z "$2" ] || [ -z "$3" ]; then
+		printf '"%s": null' "$1"
+		return
+	fi
+	printf '"%s": {"seconds": %s, "txns": %d, "max_ms": %s, "p99_ms": %s}' "$1" \
+		"$(echo "$2 $3" | awk '{ printf "%.3f", $2 - $1 }')" \
+		"$(blocked "$2" "$3" | wc -l)" \
+		"$(blocked "$2" "$3" | maximum)" \
+		"$(blocked "$2" "$3" | percentile 99)"
+}
+
+{
+	printf '{"benchmark": "locks", "clients": %d, "long_queries": %d, "long_secs": %d, ' \
+		"$BENCH_CLIENTS" "$BENCH_LONG_QUERIES" "$BENCH_LONG_SECS"
+	tps=$(pgbench_tps "$out/pgbench.txt")
+	printf '"tps": %s, "p99_ms": %s, ' "${tps:-0}" \
+		"$(pgbench_latencies "$out/txn" | percentile 99)"
+	window setup "$setup" "$handoff"; printf ', '
+	window handoff "$handoff" "$copy"; printf ', '
+	window swap "$swap" "$drop"; printf ', '
+	window drop "$drop" "${analyze:-$last}"; printf '}\n'
+} > "$out/summary.json"
+cat "$out/summary.json"
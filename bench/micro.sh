@@ -0,0 +1,54 @@
+#!/usr/bin/env bash
+#
+# pg_repack: bench/micro.sh
+#
+# Measure the throughput, in rows per second, of repack_trigger capturing
+# changes into the log table and of repack_apply replaying them, for each
+# combination of row width, TOAST size, primary key width and operation mix.
+# One JSON object is printed per combination.
+#
+
+set -e
+. "$(dirname "$0")/common.sh"
+
+: ${BENCH_ROWS:=100000}				# rows in the table
+: ${BENCH_OPS:=50000}				# changes captured and applied per case
+: ${BENCH_WIDTHS:="100 1000"}		# bytes of payload in each row
+: ${BENCH_TOASTS:="0 8192"}			# bytes of TOASTed data in each row
+: ${BENCH_PK_COLS:="1 4"}			# number of integer primary key columns
+: ${BENCH_MIXES:="100:0:0 0:100:0 0:0:100 20:70:10"}	# insert:update:delete %
+
+out=$BENCH_OUT/micro
+rm -rf "$out"
+mkdir -p "$out"
+
+setup_db
+$PSQL -f "$BENCH_DIR/micro.sql"
+
+for width in $BENCH_WIDTHS; do
+for toast in $BENCH_TOASTS; do
+for pk_cols in $BENCH_PK_COLS; do
+for mix in $BENCH_MIXES; do
+	IFS=: read ins_pct upd_pct del_pct <<< "$mix"
+	ins=$((BENCH_OPS * ins_pct / 100))
+	upd=$((BENCH_OPS * upd_pct / 100))
+	del=$((BENCH_OPS * del_pct / 100))
+	ops=$((ins + upd + del))
+
+	sql "SELECT repack_bench.setup($width, $toast, $pk_cols, $BENCH_ROWS)" > /dev/null
+	read baseline capture <<< "$(sql "SELECT * FROM repack_bench.capture($BENCH_ROWS, $ins, $upd, $del, $width, $toast)")"
+	read applied apply <<< "$(sql "SELECT * FROM repack_bench.apply()")"
+
+	awk -v width=$width -v toast=$toast -v pk_cols=$pk_cols -v mix=$mix \
+		-v ops=$ops -v baseline=$baseline -v capture=$capture \
+		-v applied=$applied -v apply=$apply '
+	function rate(n, secs) { return secs > 0 ? n / secs : 0 }
+	BEGIN {
+		printf "{\"benchmark\": \"micro\", \"width\": %d, \"toast\": %d, \"pk_cols\": %d, \"mix\": \"%s\", \"ops\": %d, ", width, toast, pk_cols, mix, ops
+		printf "\"baseline_rows_per_sec\": %.0f, \"capture_rows_per_sec\": %.0f, \"capture_overhead_sec\": %.3f, ", rate(ops, baseline), rate(ops, capture), capture - baseline
+		printf "\"applied\": %d, \"apply_rows_per_sec\": %.0f}\n", applied, rate(applied, apply)
+	}'
+done
+done
+done
+done | tee "$out/results.json"
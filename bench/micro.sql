@@ -0,0 +1,136 @@
+--
+-- pg_repack: bench/micro.sql
+--
+-- Functions used by micro.sh to measure the throughput of repack_trigger
+-- (capture of the changes in the log table) and repack_apply (replay of the
+-- log into the new table) outside of a full pg_repack run.
+--
+
+-- drop what a previous run left behind in the repack schema
+DO $$
+BEGIN
+	IF to_regclass('repack_bench.t') IS NOT NULL THEN
+		EXECUTE 'DROP TABLE IF EXISTS repack.log_' || 'repack_bench.t'::regclass::oid ||
+			', repack.table_' || 'repack_bench.t'::regclass::oid;
+		EXECUTE 'DROP TYPE IF EXISTS repack.pk_' || 'repack_bench.t'::regclass::oid;
+	END IF;
+END
+$$;
+
+DROP SCHEMA IF EXISTS repack_bench CASCADE;
+CREATE SCHEMA repack_bench;
+
+-- Create repack_bench.t with pk_cols integer key columns, a payload of width
+-- bytes and an incompressible value of toast bytes, load nrows rows in it,
+-- then set up the log table, the trigger and the new table the way pg_repack
+-- does and copy the rows into the new table.
+CREATE FUNCTION repack_bench.setup(width integer, toast integer, pk_cols integer, nrows integer)
+RETURNS void AS
+$$
+DECLARE
+	relid	oid;
+	keys	text;
+	r		repack.tables%ROWTYPE;
+BEGIN
+	relid := to_regclass('repack_bench.t');
+	IF relid IS NOT NULL THEN
+		EXECUTE 'DROP TABLE IF EXISTS repack.log_' || relid || ', repack.table_' || relid;
+		EXECUTE 'DROP TYPE IF EXISTS repack.pk_' || relid;
+		DROP TABLE repack_bench.t;
+	END IF;
+
+	SELECT string_agg('k' || i, ', ') INTO keys FROM generate_series(1, pk_cols) i;
+	EXECUTE 'CREATE TABLE repack_bench.t (' ||
+		(SELECT string_agg('k' || i || ' integer NOT NULL', ', ') FROM generate_series(1, pk_cols) i) ||
+		', n integer NOT NULL DEFAULT 0, payload text, big text, PRIMARY KEY (' || keys || '))';
+	PERFORM repack_bench.insert_rows(1, nrows, width, toast);
+	relid := 'repack_bench.t'::regclass;
+
+	SELECT * INTO r FROM repack.tables WHERE tables.relid = setup.relid;
+	EXECUTE r.create_pktype;
+	EXECUTE r.create_log;
+	EXECUTE r.create_trigger;
+	EXECUTE r.enable_trigger;
+	PERFORM repack.create_table(relid, r.tablespace_orig);
+	EXECUTE r.copy_data;
+END
+$$
+LANGUAGE plpgsql;
+
+-- Insert the rows first .. last in repack_bench.t
+CREATE FUNCTION repack_bench.insert_rows(first integer, last integer, width integer, toast integer)
+RETURNS void AS
+$$
+DECLARE
+	pk_cols	integer;
+BEGIN
+	SELECT count(*) INTO pk_cols FROM pg_attribute
+	 WHERE attrelid = 'repack_bench.t'::regclass AND attname ~ '^k[0-9]+$';
+	EXECUTE 'INSERT INTO repack_bench.t SELECT ' ||
+		repeat('i, ', pk_cols) ||
+		'0, substr(repeat(md5(i::text), $3 / 32 + 1), 1, $3),' ||
+		' (SELECT string_agg(md5(random()::text), '''') FROM generate_series(1, $4 / 32) WHERE i > 0)' ||
+		' FROM generate_series($1, $2) i'
+	USING first, last, width, toast;
+END
+$$
+LANGUAGE plpgsql;
+
+-- Run ins inserts, upd updates and del deletes on repack_bench.t, whose rows
+-- are numbered 1 to nrows, and return the elapsed time in seconds.
+CREATE FUNCTION repack_bench.dml(nrows integer, ins integer, upd integer, del integer,
+								 width integer, toast integer)
+RETURNS float8 AS
+$$
+DECLARE
+	t0		timestamptz := clock_timestamp();
+BEGIN
+	IF ins > 0 THEN
+		PERFORM repack_bench.insert_rows(nrows + 1, nrows + ins, width, toast);
+	END IF;
+	IF upd > 0 THEN
+		UPDATE repack_bench.t SET n = n + 1 WHERE k1 <= upd;
+	END IF;
+	IF del > 0 THEN
+		DELETE FROM repack_bench.t WHERE k1 > upd AND k1 <= upd + del;
+	END IF;
+	RETURN extract(epoch FROM clock_timestamp() - t0);
+END
+$$
+LANGUAGE plpgsql;
+
+-- Time the DML once without repack_trigger, rolled back, as a baseline and
+-- once with the trigger capturing the changes into the log table.
+CREATE FUNCTION repack_bench.capture(nrows integer, ins integer, upd integer, del integer,
+									 width integer, toast integer,
+									 OUT baseline_seconds float8, OUT capture_seconds float8)
+AS
+$$
+BEGIN
+	BEGIN
+		ALTER TABLE repack_bench.t DISABLE TRIGGER repack_trigger;
+		baseline_seconds := repack_bench.dml(nrows, ins, upd, del, width, toast);
+		RAISE EXCEPTION 'rollback';
+	EXCEPTION WHEN raise_exception THEN
+		NULL;
+	END;
+	capture_seconds := repack_bench.dml(nrows, ins, upd, del, width, toast);
+END
+$$
+LANGUAGE plpgsql;
+
+-- Replay the whole log into the new table with repack_apply.
+CREATE FUNCTION repack_bench.apply(OUT applied integer, OUT apply_seconds float8)
+AS
+$$
+DECLARE
+	r		repack.tables%ROWTYPE;
+	t0		timestamptz := clock_timestamp();
+BEGIN
+	SELECT * INTO r FROM repack.tables WHERE relid = 'repack_bench.t'::regclass;
+	applied := repack.repack_apply(r.sql_peek::cstring, r.sql_insert::cstring,
+		r.sql_delete::cstring, r.sql_update::cstring, r.sql_pop::cstring, 0);
+	apply_seconds := extract(epoch FROM clock_timestamp() - t0);
+END
+$$
+LANGUAGE plpgsql;
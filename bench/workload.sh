@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+#
+# pg_repack: bench/workload.sh
+#
+# Run pg_repack on a table while pgbench runs a read/write workload against
+# it, and report the throughput and latency seen by the application, the
+# duration of the repack, the peak size of the log table and the lock waits.
+#
+
+set -e
+. "$(dirname "$0")/common.sh"
+
+: ${BENCH_ROWS:=1000000}		# rows in the table
+: ${BENCH_WIDTH:=200}			# bytes of padding in each row
+: ${BENCH_CLIENTS:=8}			# pgbench clients
+: ${BENCH_DURATION:=60}			# seconds of pgbench load
+: ${BENCH_WRITE_PCT:=20}		# percentage of write transactions
+: ${BENCH_SKEW:=1.1}			# zipfian skew of the accessed rows, 0 for uniform
+: ${BENCH_REPACK:=1}			# 0 to measure the workload alone
+: ${REPACK_OPTS:=}				# extra options given to pg_repack
+
+out=$BENCH_OUT/workload
+rm -rf "$out"
+mkdir -p "$out"
+
+setup_db
+$PSQL <<SQL
+DROP TABLE IF EXISTS bench_tbl;
+CREATE TABLE bench_tbl (id bigint PRIMARY KEY, hot integer NOT NULL DEFAULT 0, pad text);
+INSERT INTO bench_tbl
+	SELECT i, 0, substr(repeat(md5(i::text), ($BENCH_WIDTH + 31) / 32), 1, $BENCH_WIDTH)
+	FROM generate_series(1, $BENCH_ROWS) i;
+-- leave some bloat behind for pg_repack to remove
+UPDATE bench_tbl SET hot = 1 WHERE id % 4 = 0;
+VACUUM ANALYZE bench_tbl;
+SQL
+
+if [ "$BENCH_SKEW" = 0 ]; then
+	pick="\\set id random(1, $BENCH_ROWS)"
+else
+	pick="\\set id random_zipfian(1, $BENCH_ROWS, $BENCH_SKEW)"
+fi
+printf '%s\nSELECT hot, length(pad) FROM bench_tbl WHERE id = :id;\n' "$pick" > "$out/read.sql"
+printf '%s\nUPDATE bench_tbl SET hot = hot + 1 WHERE id = :id;\n' "$pick" > "$out/write.sql"
+
+pgbench -n -c "$BENCH_CLIENTS" -j "$BENCH_CLIENTS" -T "$BENCH_DURATION" \
+	-l --log-prefix="$out/txn" \
+	-f "$out/read.sql@$((100 - BENCH_WRITE_PCT))" \
+	-f "$out/write.sql@$BENCH_WRITE_PCT" > "$out/pgbench.txt" 2>&1 &
+bench_pid=$!
+monitor "$out/monitor.txt" &
+monitor_pid=$!
+
+# let the workload settle before starting the repack
+sleep $((BENCH_DURATION / 6))
+
+repack_start=0
+repack_end=0
+if [ "$BENCH_REPACK" != 0 ]; then
+	repack_start=$(now)
+	$PG_REPACK --dbname="$PGDATABASE" --table=bench_tbl $REPACK_OPTS > "$out/repack.txt" 2>&1 ||
+		echo "pg_repack failed, see $out/repack.txt" >&2
+	repack_end=$(now)
+fi
+
+wait $bench_pid
+kill $monitor_pid
+wait $monitor_pid 2>/dev/null || true
+
+tps=$(pgbench_tps "$out/pgbench.txt")
+p50=$(pgbench_latencies "$out/txn" | percentile 50)
+p99=$(pgbench_latencies "$out/txn" | percentile 99)
+repack_p99=$(pgbench_latencies "$out/txn" "$repack_start" "$repack_end" | percentile 99)
+repack_secs=$(echo "$repack_start $repack_end" | awk '{ printf "%.3f", $2 - $1 }')
+log_peak=$(awk '{ print $2 }' "$out/monitor.txt" | maximum)
+lock_samples=$(awk '$3 > 0' "$out/monitor.txt" | wc -l)
+lock_max=$(awk '{ print $3 }' "$out/monitor.txt" | maximum)
+
+cat > "$out/summary.json" <<JSON
+{"benchmark": "workload", "rows": $BENCH_ROWS, "width": $BENCH_WIDTH, "clients": $BENCH_CLIENTS, "write_pct": $BENCH_WRITE_PCT, "skew": $BENCH_SKEW, "tps": ${tps:-0}, "latency_p50_ms": $p50, "latency_p99_ms": $p99, "repack_latency_p99_ms": $repack_p99, "repack_seconds": $repack_secs, "log_peak_bytes": $log_peak, "lock_wait_samples": $lock_samples, "lock_waiters_max": $lock_max}
+JSON
+cat "$out/summary.json"
@@ -53,9 +53,31 @@ const char *PROGRAM_VERSION = "unknown";
  */
 #define SWITCH_THRESHOLD_DEFAULT	100
 
+/* Number of pages emptied per transaction by --compact */
+#define COMPACT_PAGES	8
+
 /* poll() or select() timeout, in seconds */
 #define POLL_TIMEOUT    3
 
+/*
+ * Default length, in seconds, of the interval over which --estimate samples
+ * the write activity of each table.
+ */
+#define ESTIMATE_INTERVAL_DEFAULT	10
+
+/*
+ * Throughput figures used by --estimate to turn sizes and row counts into
+ * durations. They are deliberately conservative single-process figures; the
+ * real numbers depend on the hardware, maintenance_work_mem and concurrent
+ * load, so the estimate should be read as an order of magnitude.
+ */
+#define ESTIMATE_COPY_BYTES_PER_SEC		(64.0 * 1024 * 1024)
+#define ESTIMATE_INDEX_BYTES_PER_SEC	(32.0 * 1024 * 1024)
+#define ESTIMATE_APPLY_ROWS_PER_SEC		20000.0
+
+/* Per-row overhead of the log table (tuple header, id, pk and index entry) */
+#define ESTIMATE_LOG_ROW_OVERHEAD		64.0
+
 /* Compile an array of existing transactions which are active during
  * pg_repack's setup. Some transactions we can safely ignore:
  *  a. The '1/1, -1/0' lock skipped is from the bgwriter on newly promoted
@@ -134,6 +156,17 @@ const char *PROGRAM_VERSION = "unknown";
 	"SELECT pid FROM pg_locks WHERE locktype = 'virtualxid'"\
 	" AND pid <> pg_backend_pid() AND virtualtransaction = ANY($1)"
 
+/* Queries on the hot standby which would conflict with the replay of the
+ * AccessExclusive lock taken for the swap, oldest first. Physical standbys
+ * share the OIDs of the primary, so the table is looked up by OID.
+ */
+#define SQL_STANDBY_CONFLICTS \
+	"SELECT l.pid FROM pg_locks l JOIN pg_stat_activity a ON a.pid = l.pid"\
+	" WHERE l.locktype = 'relation' AND l.pid <> pg_backend_pid()"\
+	" AND l.relation = $1"\
+	" AND l.database = (SELECT oid FROM pg_database WHERE datname = $2)"\
+	" ORDER BY a.xact_start"
+
 /* To be run while our main connection holds an AccessExclusive lock on the
  * target table, and our secondary conn is attempting to grab an AccessShare
  * lock. We know that "granted" must be false for these queries because
@@ -206,6 +239,10 @@ typedef struct repack_table
 	const char	   *sql_delete;		/* SQL used in flush */
 	const char	   *sql_update;		/* SQL used in flush */
 	const char	   *sql_pop;		/* SQL used in flush */
+	const char	   *sql_purge;		/* SQL used in flush, or NULL */
+	const char	   *order_by;		/* ORDER BY of the copy, or NULL */
+	bool			capture;		/* changes go through the shared ring */
+	char		   *overlap_end;	/* last log id the standby copy may hold, or NULL */
 	int             n_indexes;      /* number of indexes */
 	repack_index   *indexes;        /* info on each index */
 } repack_table;
@@ -215,14 +252,28 @@ static bool is_superuser(void);
 static void check_tablespace(void);
 static bool preliminary_checks(char *errbuf, size_t errsize);
 static bool is_requested_relation_exists(char *errbuf, size_t errsize);
+static bool check_add_index(PGresult *tables, char *errbuf, size_t errsize);
 static void repack_all_databases(const char *order_by);
 static bool repack_one_database(const char *order_by, char *errbuf, size_t errsize);
 static void repack_one_table(repack_table *table, const char *order_by);
+static void compact_one_table(const repack_table *table);
 static bool repack_table_indexes(PGresult *index_details);
 static bool repack_all_indexes(char *errbuf, size_t errsize);
 static void repack_cleanup(bool fatal, const repack_table *table);
 static void repack_cleanup_callback(bool fatal, void *userdata);
 static bool rebuild_indexes(const repack_table *table);
+static PGresult *estimate_snapshot(PGresult *tables);
+static void estimate_table(const repack_table *table);
+static char *advise_order_by(Oid target_oid, bool *reorder, char **reason);
+static bool is_referenced(Oid target_oid);
+static bool prewarm_start(const repack_table *table);
+static bool prewarm_busy(void);
+static void prewarm_finish(const repack_table *table, bool cancel);
+static bool standby_busy(const repack_table *table, time_t *since);
+static bool standby_copy(repack_table *table, const char *orderby);
+static void throttle(PGconn *conn);
+static bool log_over_limit(const repack_table *table);
+static void analyze_queued_tables(void);
 
 static char *getstr(PGresult *res, int row, int col);
 static Oid getoid(PGresult *res, int row, int col);
@@ -262,6 +313,43 @@ static SimpleStringList	exclude_extension_list = {NULL, NULL}; /* don't repack t
 static bool 			error_on_invalid_index = false; /* don't repack when invalid index is found */
 static int				apply_count = APPLY_COUNT_DEFAULT;
 static int				switch_threshold = SWITCH_THRESHOLD_DEFAULT;
+static bool				estimate = false;
+static int				estimate_interval = ESTIMATE_INTERVAL_DEFAULT;
+static PGresult		   *estimate_before = NULL;	/* from estimate_snapshot() */
+static PGresult		   *estimate_after = NULL;
+static bool				prewarm = false;	/* load the new relations into cache before swap */
+static bool				keep_statistics = false;	/* don't ANALYZE the whole table */
+static SimpleStringList	analyze_queue = {NULL, NULL};	/* ANALYZE commands to run */
+static char			   *fillfactor = NULL;	/* "auto" or 10..100 */
+static int				toast_tuple_target = 0;	/* 0: leave unchanged */
+static SimpleStringList	compression_list = {NULL, NULL};	/* [column=]method */
+static char			   *compression_spec = NULL;	/* compression_list, comma separated */
+static int				index_fillfactor = 0;	/* 0: leave unchanged */
+static char			   *deduplicate_items = NULL;	/* "on", "off" or NULL */
+static SimpleStringList	index_tablespace_list = {NULL, NULL};	/* pattern=tblspc */
+static char			   *index_tablespace_map = NULL;	/* index_tablespace_list, one per line */
+static char			   *order_by_curve = NULL;	/* columns to order along a curve */
+static char			   *curve = "zorder";	/* "zorder" or "hilbert" */
+static bool				auto_order = false;	/* order by the advised key */
+static char			   *purge_where = NULL;	/* predicate of the rows to drop */
+static SimpleStringList	alter_column_list = {NULL, NULL};	/* column:type */
+static char			   *alter_column_spec = NULL;	/* alter_column_list, one per line */
+static SimpleStringList	add_index_list = {NULL, NULL};	/* CREATE INDEX statements */
+static char			   *access_method = NULL;	/* table access method to convert to */
+static char			   *log_tablespace = NULL;	/* tablespace of the log table */
+static char			   *sort_tablespace = NULL;	/* temp_tablespaces of the copy and index builds */
+static int				max_replay_lag = 0;	/* in MB, 0: unlimited */
+static int				max_wal_rate = 0;	/* in MB per second, 0: unlimited */
+static int				max_throttle_wait = 300;	/* in seconds, 0: unlimited */
+static char			   *standby = NULL;	/* connection string of a hot standby */
+static int				standby_wait = 60;	/* in seconds */
+static PGconn		   *standby_conn = NULL;
+static bool				copy_from_standby = false;	/* read the initial copy from the standby */
+static bool				coalesce_log = false;	/* log the net changes of transactions */
+static int				max_log_rows = 0;	/* 0: unlimited */
+static int				max_log_size = 0;	/* in MB, 0: unlimited */
+static int				log_backpressure = 0;	/* delay of the writers in ms, 0: abort */
+static bool				compact = false;	/* move the rows in place instead */
 
 /* buffer should have at least 11 bytes */
 static char *
@@ -295,6 +383,37 @@ static pgut_option options[] =
 	{ 'b', 3, "error-on-invalid-index", &error_on_invalid_index },
 	{ 'i', 2, "apply-count", &apply_count },
 	{ 'i', 1, "switch-threshold", &switch_threshold },
+	{ 'b', 4, "estimate", &estimate },
+	{ 'i', 5, "estimate-interval", &estimate_interval },
+	{ 'b', 6, "prewarm", &prewarm },
+	{ 'b', 7, "keep-statistics", &keep_statistics },
+	{ 's', 8, "fillfactor", &fillfactor },
+	{ 'i', 9, "toast-tuple-target", &toast_tuple_target },
+	{ 'l', 10, "compression", &compression_list },
+	{ 'i', 11, "index-fillfactor", &index_fillfactor },
+	{ 's', 12, "deduplicate-items", &deduplicate_items },
+	{ 'l', 13, "index-tablespace", &index_tablespace_list },
+	{ 's', 14, "order-by-curve", &order_by_curve },
+	{ 's', 15, "curve", &curve },
+	{ 'b', 16, "auto-order", &auto_order },
+	{ 's', 17, "purge-where", &purge_where },
+	{ 'l', 18, "alter-column", &alter_column_list },
+	{ 'l', 19, "add-index", &add_index_list },
+	{ 's', 20, "access-method", &access_method },
+	{ 's', 21, "log-tablespace", &log_tablespace },
+	{ 's', 22, "sort-tablespace", &sort_tablespace },
+	{ 'i', 23, "max-replay-lag", &max_replay_lag },
+	{ 'i', 24, "max-wal-rate", &max_wal_rate },
+	{ 's', 25, "standby", &standby },
+	{ 'i', 26, "standby-wait", &standby_wait },
+	{ 'b', 27, "copy-from-standby", &copy_from_standby },
+	{ 'b', 28, "coalesce-log", &coalesce_log },
+	{ 'i', 29, "max-log-rows", &max_log_rows },
+	{ 'i', 30, "max-log-size", &max_log_size },
+	{ 'i', 31, "log-backpressure", &log_backpressure },
+	/* 32 to 126 are printable, and would be taken as short options */
+	{ 'b', 128, "compact", &compact },
+	{ 'i', 129, "max-throttle-wait", &max_throttle_wait },
 	{ 0 },
 };
 
@@ -322,10 +441,161 @@ main(int argc, char *argv[])
 	if (dryrun)
 		elog(INFO, "Dry run enabled, not executing repack");
 
+	if (estimate_interval < 1)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--estimate-interval must be greater than 0")));
+
+	if (estimate)
+	{
+		if (r_index.head || only_indexes)
+			ereport(ERROR, (errcode(EINVAL),
+				errmsg("cannot specify --estimate and --index (-i) or --only-indexes (-x)")));
+		elog(INFO, "Estimate mode enabled, not executing repack");
+	}
+
 	if (max_lock_timeout_msec < 1 || max_lock_timeout_msec > 1000)
 		ereport(ERROR, (errcode(EINVAL),
 			errmsg("--max-lock-timeout must be between 1 and 1000")));
 
+	if (fillfactor && strcmp(fillfactor, "auto") != 0 &&
+		(strspn(fillfactor, "0123456789") != strlen(fillfactor) ||
+		 atoi(fillfactor) < 10 || atoi(fillfactor) > 100))
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--fillfactor must be \"auto\" or between 10 and 100")));
+
+	if (max_replay_lag < 0)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--max-replay-lag must not be negative")));
+
+	if (max_wal_rate < 0)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--max-wal-rate must not be negative")));
+
+	if (max_throttle_wait < 0)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--max-throttle-wait must not be negative")));
+
+	if (standby_wait < 0)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--standby-wait must not be negative")));
+
+	if (copy_from_standby && !standby)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--copy-from-standby requires --standby")));
+
+	if (max_log_rows < 0)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--max-log-rows must not be negative")));
+
+	if (max_log_size < 0)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--max-log-size must not be negative")));
+
+	if (log_backpressure != 0 && (log_backpressure < 1 || log_backpressure > 1000))
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--log-backpressure must be between 1 and 1000")));
+
+	if (log_backpressure && !max_log_rows)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--log-backpressure requires --max-log-rows")));
+
+	if (log_backpressure && coalesce_log)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--log-backpressure cannot be used with --coalesce-log")));
+
+	if (toast_tuple_target != 0 &&
+		(toast_tuple_target < 128 || toast_tuple_target > 8160))
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--toast-tuple-target must be between 128 and 8160")));
+
+	if (compression_list.head)
+	{
+		SimpleStringListCell   *cell;
+		StringInfoData			spec;
+
+		initStringInfo(&spec);
+		for (cell = compression_list.head; cell; cell = cell->next)
+		{
+			const char *method = strchr(cell->val, '=');
+
+			method = method ? method + 1 : cell->val;
+			if (strcmp(method, "pglz") != 0 && strcmp(method, "lz4") != 0)
+				ereport(ERROR, (errcode(EINVAL),
+					errmsg("--compression method must be pglz or lz4: \"%s\"",
+						   cell->val)));
+			if (spec.len > 0)
+				appendStringInfoChar(&spec, ',');
+			appendStringInfoString(&spec, cell->val);
+		}
+		compression_spec = spec.data;
+	}
+
+	if (strcmp(curve, "zorder") != 0 && strcmp(curve, "hilbert") != 0)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--curve must be zorder or hilbert")));
+
+	if (order_by_curve && (orderby || noorder))
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("cannot specify --order-by-curve and --order-by (-o) or --no-order (-n)")));
+
+	if (auto_order && (orderby || noorder || order_by_curve))
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("cannot specify --auto-order and --order-by (-o), --no-order (-n) or --order-by-curve")));
+
+	if (index_fillfactor != 0 &&
+		(index_fillfactor < 10 || index_fillfactor > 100))
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--index-fillfactor must be between 10 and 100")));
+
+	if (deduplicate_items && strcmp(deduplicate_items, "on") != 0 &&
+		strcmp(deduplicate_items, "off") != 0)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--deduplicate-items must be on or off")));
+
+	if (index_tablespace_list.head)
+	{
+		SimpleStringListCell   *cell;
+		StringInfoData			map;
+
+		initStringInfo(&map);
+		for (cell = index_tablespace_list.head; cell; cell = cell->next)
+		{
+			const char *eq = strchr(cell->val, '=');
+
+			if (eq == NULL || eq == cell->val || eq[1] == '\0' ||
+				strchr(cell->val, '\n'))
+				ereport(ERROR, (errcode(EINVAL),
+					errmsg("--index-tablespace must be PATTERN=TBLSPC: \"%s\"",
+						   cell->val)));
+			if (map.len > 0)
+				appendStringInfoChar(&map, '\n');
+			appendStringInfoString(&map, cell->val);
+		}
+		index_tablespace_map = map.data;
+	}
+
+	if (alter_column_list.head)
+	{
+		SimpleStringListCell   *cell;
+		StringInfoData			spec;
+
+		initStringInfo(&spec);
+		for (cell = alter_column_list.head; cell; cell = cell->next)
+		{
+			const char *colon = strchr(cell->val, ':');
+
+			if (colon == NULL || colon == cell->val || colon[1] == '\0' ||
+				strchr(cell->val, '\n'))
+				ereport(ERROR, (errcode(EINVAL),
+					errmsg("--alter-column must be COLUMN:TYPE: \"%s\"",
+						   cell->val)));
+			if (spec.len > 0)
+				appendStringInfoChar(&spec, '\n');
+			appendStringInfoString(&spec, cell->val);
+		}
+		alter_column_spec = spec.data;
+	}
+
 	if (r_index.head || only_indexes)
 	{
 		if (r_index.head && table_list.head)
@@ -358,12 +628,54 @@ main(int argc, char *argv[])
 			else if (noorder)
 				ereport(WARNING, (errcode(EINVAL),
 					errmsg("option -n (--no-order) has no effect while repacking indexes")));
+			else if (order_by_curve)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("option --order-by-curve has no effect while repacking indexes")));
+			else if (auto_order)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("option --auto-order has no effect while repacking indexes")));
+			else if (purge_where)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("option --purge-where has no effect while repacking indexes")));
+			else if (alter_column_spec)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("option --alter-column has no effect while repacking indexes")));
+			else if (add_index_list.head)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("option --add-index has no effect while repacking indexes")));
+			else if (access_method)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("option --access-method has no effect while repacking indexes")));
+			else if (log_tablespace)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("option --log-tablespace has no effect while repacking indexes")));
+			else if (max_wal_rate || max_replay_lag)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("options --max-wal-rate and --max-replay-lag have no effect while repacking indexes")));
+			else if (standby)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("option --standby has no effect while repacking indexes")));
+			else if (coalesce_log)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("option --coalesce-log has no effect while repacking indexes")));
+			else if (max_log_rows || max_log_size)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("options --max-log-rows and --max-log-size have no effect while repacking indexes")));
+			else if (compact)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("option --compact has no effect while repacking indexes")));
 			else if (!analyze)
 				ereport(WARNING, (errcode(EINVAL),
 					errmsg("ANALYZE is not performed after repacking indexes, -z (--no-analyze) has no effect")));
 			else if (jobs)
 				ereport(WARNING, (errcode(EINVAL),
 					errmsg("option -j (--jobs) has no effect, repacking indexes does not use parallel jobs")));
+			else if (prewarm)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("option --prewarm has no effect while repacking indexes")));
+			else if (fillfactor || toast_tuple_target || compression_spec)
+				ereport(WARNING, (errcode(EINVAL),
+					errmsg("options --fillfactor, --toast-tuple-target and --compression have no effect while repacking indexes")));
 			if (!repack_all_indexes(errbuf, sizeof(errbuf)))
 				ereport(ERROR,
 					(errcode(ERROR), errmsg("%s", errbuf)));
@@ -562,6 +874,15 @@ preliminary_checks(char *errbuf, size_t errsize){
 	}
 	CLEARPGRES(res);
 
+	/* deduplicate_items is new in PostgreSQL 13 */
+	if (deduplicate_items && PQserverVersion(connection) < 130000)
+	{
+		if (errbuf)
+			snprintf(errbuf, errsize,
+					 "--deduplicate-items requires PostgreSQL 13 or later");
+		goto cleanup;
+	}
+
 	/* Disable statement timeout. */
 	command("SET statement_timeout = 0", 0, NULL);
 
@@ -689,6 +1010,65 @@ cleanup:
 	return ret;
 }
 
+/*
+ * Check the statements of --add-index: each must name one of the tables to
+ * repack, the rows of tables from repack.tables, lest it be dropped silently.
+ * With --all, a statement on a table missing from the database is left to
+ * the other databases.
+ */
+static bool
+check_add_index(PGresult *tables, char *errbuf, size_t errsize)
+{
+	SimpleStringListCell   *cell;
+
+	for (cell = add_index_list.head; cell; cell = cell->next)
+	{
+		const char *stmt = cell->val;
+		PGresult   *res;
+		Oid			relid;
+		int			i;
+
+		res = execute_elevel("SELECT relid FROM repack.get_add_index($1)", 1,
+							 &stmt, DEBUG2);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		{
+			if (errbuf)
+				snprintf(errbuf, errsize, "%s", PQerrorMessage(connection));
+			CLEARPGRES(res);
+			return false;
+		}
+		if (PQgetisnull(res, 0, 0))
+		{
+			CLEARPGRES(res);
+			if (alldb)
+				continue;
+			if (errbuf)
+				snprintf(errbuf, errsize,
+						 "the table of --add-index statement \"%s\" does not exist",
+						 stmt);
+			return false;
+		}
+		relid = getoid(res, 0, 0);
+		CLEARPGRES(res);
+
+		for (i = 0; i < PQntuples(tables); i++)
+		{
+			if (getoid(tables, i, 1) == relid)
+				break;
+		}
+		if (i == PQntuples(tables))
+		{
+			if (errbuf)
+				snprintf(errbuf, errsize,
+						 "the table of --add-index statement \"%s\" is not among the tables to repack",
+						 stmt);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 /*
  * Call repack_one_database for each database.
  */
@@ -791,6 +1171,76 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 	if (!is_requested_relation_exists(errbuf, errsize))
 		goto cleanup;
 
+	/* ALTER TABLE ... SET COMPRESSION is new in PostgreSQL 14 */
+	if (compression_spec && PQserverVersion(connection) < 140000)
+	{
+		if (errbuf)
+			snprintf(errbuf, errsize,
+					 "--compression requires PostgreSQL 14 or later");
+		goto cleanup;
+	}
+
+	if (access_method)
+	{
+		const char *am_params[1];
+
+		am_params[0] = access_method;
+		res = execute("SELECT 1 FROM pg_am WHERE amname = $1", 1, am_params);
+		if (PQntuples(res) == 0)
+		{
+			if (errbuf)
+				snprintf(errbuf, errsize,
+						 "table access method \"%s\" does not exist",
+						 access_method);
+			goto cleanup;
+		}
+		CLEARPGRES(res);
+
+		/* table access methods are new in PostgreSQL 12 */
+		if (PQserverVersion(connection) < 120000)
+		{
+			if (errbuf)
+				snprintf(errbuf, errsize,
+						 "--access-method requires PostgreSQL 12 or later");
+			goto cleanup;
+		}
+	}
+
+	/* the scratch tablespaces are checked before anything goes there */
+	for (i = 0; i < 2; i++)
+	{
+		const char *spc_params[1];
+
+		spc_params[0] = i == 0 ? log_tablespace : sort_tablespace;
+		if (spc_params[0] == NULL)
+			continue;
+		res = execute("SELECT 1 FROM pg_tablespace WHERE spcname = $1",
+					  1, spc_params);
+		if (PQntuples(res) == 0)
+		{
+			if (errbuf)
+				snprintf(errbuf, errsize,
+						 "tablespace \"%s\" does not exist", spc_params[0]);
+			goto cleanup;
+		}
+		CLEARPGRES(res);
+	}
+
+	if (standby)
+	{
+		standby_conn = pgut_connect(standby, NULL, NULL, username, password,
+									prompt_password, ERROR);
+		res = pgut_execute(standby_conn, "SELECT pg_is_in_recovery()", 0, NULL);
+		if (strcmp(getstr(res, 0, 0), "t") != 0)
+		{
+			if (errbuf)
+				snprintf(errbuf, errsize,
+						 "--standby must connect to a hot standby");
+			goto cleanup;
+		}
+		CLEARPGRES(res);
+	}
+
 	/* acquire target tables */
 	appendStringInfoString(&sql,
 		"SELECT t.*,"
@@ -903,11 +1353,25 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 
 	num = PQntuples(res);
 
+	/* check the statements of --add-index before copying anything */
+	if (!check_add_index(res, errbuf, errsize))
+		goto cleanup;
+
+	/* sample the write activity of all the tables over a single interval */
+	if (estimate && num > 0)
+	{
+		estimate_before = estimate_snapshot(res);
+		sleep(estimate_interval);
+		estimate_after = estimate_snapshot(res);
+	}
+
 	for (i = 0; i < num; i++)
 	{
 		repack_table	table;
 		StringInfoData	copy_sql;
 		const char *ckey;
+		char	   *advised;
+		bool		reorder;
 		int			c = 0;
 
 		table.target_name = getstr(res, i, c++);
@@ -944,69 +1408,892 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 		table.sql_delete = getstr(res, i, c++);
 		table.sql_update = getstr(res, i, c++);
 		table.sql_pop = getstr(res, i, c++);
+		table.sql_purge = NULL;
 		table.dest_tablespace = getstr(res, i, c++);
 
-		/* Craft Copy SQL */
-		initStringInfo(&copy_sql);
-		appendStringInfoString(&copy_sql, table.copy_data);
-		if (!orderby)
+		/*
+		 * Values copied as they are keep their compression, so detoast the
+		 * columns to compress with another method. The columns to alter are
+		 * cast to their new types, in the copy and in the replay of the log.
+		 */
+		if (compression_spec || alter_column_spec)
+		{
+			PGresult   *copy_res;
+			const char *copy_params[3];
+			char		buffer[12];
+
+			copy_params[0] = utoa(table.target_oid, buffer);
+			copy_params[1] = compression_spec ? compression_spec : "";
+			copy_params[2] = alter_column_spec ? alter_column_spec : "";
+			copy_res = execute("SELECT repack.get_copy_data($1, $2, $3)",
+							   3, copy_params);
+			table.copy_data = pgut_strdup(getstr(copy_res, 0, 0));
+			CLEARPGRES(copy_res);
+		}
+		if (coalesce_log || log_backpressure)
+		{
+			PGresult   *trigger_res;
+			const char *trigger_params[5];
+			char		buffer[12];
+			char		pkbuffer[12];
+			char		rowsbuffer[12];
+			char		delaybuffer[12];
+
+			trigger_params[0] = utoa(table.target_oid, buffer);
+			trigger_params[1] = utoa(table.pkid, pkbuffer);
+			trigger_params[2] = coalesce_log ? "true" : "false";
+			trigger_params[3] = utoa(max_log_rows, rowsbuffer);
+			trigger_params[4] = utoa(log_backpressure, delaybuffer);
+			trigger_res = execute("SELECT repack.get_create_trigger($1, $2, $3, $4, $5)",
+								  5, trigger_params);
+			table.create_trigger = pgut_strdup(getstr(trigger_res, 0, 0));
+			CLEARPGRES(trigger_res);
+		}
+		if (alter_column_spec)
+		{
+			PGresult   *alter_res;
+			const char *alter_params[3];
+			char		buffer[12];
+			char		pkbuffer[12];
+
+			alter_params[0] = utoa(table.target_oid, buffer);
+			alter_params[1] = utoa(table.pkid, pkbuffer);
+			alter_params[2] = alter_column_spec;
+			alter_res = execute("SELECT * FROM repack.get_alter_apply($1, $2, $3)",
+								3, alter_params);
+			table.sql_insert = pgut_strdup(getstr(alter_res, 0, 0));
+			table.sql_update = pgut_strdup(getstr(alter_res, 0, 1));
+			CLEARPGRES(alter_res);
+		}
+
+		/* Craft Copy SQL */
+		initStringInfo(&copy_sql);
+		appendStringInfoString(&copy_sql, table.copy_data);
+		if (purge_where)
+		{
+			StringInfoData	purge_sql;
+
+			/*
+			 * The rows are removed without firing the triggers or checking
+			 * the foreign keys, so don't break the references to the table.
+			 */
+			if (is_referenced(table.target_oid))
+			{
+				ereport(WARNING,
+						(errcode(E_PG_COMMAND),
+						 errmsg("relation \"%s\" is referenced by a foreign key, skipped with --purge-where",
+								table.target_name)));
+				termStringInfo(&copy_sql);
+				continue;
+			}
+
+			appendStringInfo(&copy_sql, " WHERE NOT coalesce((%s), false)",
+							 purge_where);
+
+			/* rows replayed from the log are tested with this */
+			initStringInfo(&purge_sql);
+			appendStringInfo(&purge_sql,
+							 "SELECT 1 FROM (SELECT ($1).*) r"
+							 " WHERE coalesce((%s), false)", purge_where);
+			table.sql_purge = purge_sql.data;
+		}
+		table.order_by = NULL;
+		table.capture = false;
+		table.overlap_end = NULL;
+		if (order_by_curve)
+		{
+			/* Space-filling curve over the columns */
+			PGresult   *curve_res;
+			const char *curve_params[3];
+			char		buffer[12];
+
+			curve_params[0] = utoa(table.target_oid, buffer);
+			curve_params[1] = order_by_curve;
+			curve_params[2] = curve;
+			curve_res = execute("SELECT repack.get_curve_order_by($1, $2, $3)",
+								3, curve_params);
+			appendStringInfoString(&copy_sql, " ORDER BY ");
+			appendStringInfoString(&copy_sql, getstr(curve_res, 0, 0));
+			table.order_by = order_by_curve;
+			CLEARPGRES(curve_res);
+		}
+		else if (auto_order &&
+				 (advised = advise_order_by(table.target_oid, &reorder, NULL)) != NULL)
+		{
+			/*
+			 * Advised clustering key. The rows are copied in their physical
+			 * order if they already follow it, which keeps them ordered
+			 * without a sort.
+			 */
+			if (reorder)
+			{
+				elog(INFO, "advised order for \"%s\": %s", table.target_name,
+					 advised);
+				appendStringInfoString(&copy_sql, " ORDER BY ");
+				appendStringInfoString(&copy_sql, advised);
+				table.order_by = advised;
+			}
+			else
+				elog(INFO, "advised order for \"%s\": %s, already ordered",
+					 table.target_name, advised);
+		}
+		else if (!orderby)
+
+		{
+			if (ckey != NULL)
+			{
+				/* CLUSTER mode */
+				appendStringInfoString(&copy_sql, " ORDER BY ");
+				appendStringInfoString(&copy_sql, ckey);
+				table.order_by = ckey;
+			}
+
+			/* else, VACUUM FULL mode (non-clustered tables) */
+		}
+		else if (!orderby[0])
+		{
+			/* VACUUM FULL mode (for clustered tables too), do nothing */
+		}
+		else
+		{
+			/* User specified ORDER BY */
+			appendStringInfoString(&copy_sql, " ORDER BY ");
+			appendStringInfoString(&copy_sql, orderby);
+			table.order_by = orderby;
+		}
+
+		/*
+		 * A throttled copy passes the rows on their way to the new table,
+		 * after any sort, through repack.throttle(), which waits while the
+		 * WAL goes too fast or the standbys lag behind. A copy from the
+		 * standby runs the SELECT there and is throttled by standby_copy().
+		 */
+		if ((max_wal_rate || max_replay_lag) && !copy_from_standby)
+		{
+			StringInfoData	throttled_sql;
+			char			prefix[64];
+			int				len;
+
+			len = snprintf(prefix, sizeof(prefix),
+						   "INSERT INTO repack.table_%u ", table.target_oid);
+			Assert(strncmp(copy_sql.data, prefix, len) == 0);
+
+			initStringInfo(&throttled_sql);
+			appendStringInfo(&throttled_sql,
+							 "%sSELECT * FROM (%s) r WHERE repack.throttle(%d, %d, %d)",
+							 prefix, copy_sql.data + len,
+							 max_wal_rate, max_replay_lag, max_throttle_wait);
+			termStringInfo(&copy_sql);
+			copy_sql = throttled_sql;
+		}
+		table.copy_data = copy_sql.data;
+
+		if (compact)
+			compact_one_table(&table);
+		else
+			repack_one_table(&table, orderby);
+		free(table.overlap_end);
+	}
+
+	analyze_queued_tables();
+	ret = true;
+
+cleanup:
+	CLEARPGRES(res);
+	CLEARPGRES(estimate_before);
+	CLEARPGRES(estimate_after);
+	disconnect();
+	if (standby_conn)
+	{
+		pgut_disconnect(standby_conn);
+		standby_conn = NULL;
+	}
+	termStringInfo(&sql);
+	free(params);
+	return ret;
+}
+
+static int
+apply_log(PGconn *conn, const repack_table *table, int count)
+{
+	int			result;
+	PGresult   *res;
+	const char *params[8];
+	char		buffer[12];
+
+	params[0] = table->sql_peek;
+	params[1] = table->sql_insert;
+	params[2] = table->sql_delete;
+	params[3] = table->sql_update;
+	params[4] = table->sql_pop;
+	params[5] = utoa(count, buffer);
+	params[6] = table->sql_purge;
+	params[7] = table->overlap_end ? table->overlap_end : "0";
+
+	/* move committed changes from the shared ring into the log first */
+	if (table->capture)
+	{
+		char		oid[12];
+		const char *oid_param = utoa(table->target_oid, oid);
+
+		pgut_command(conn, "SELECT repack.capture_drain($1)", 1, &oid_param);
+	}
+
+	res = pgut_execute(conn,
+					   "SELECT repack.repack_apply($1, $2, $3, $4, $5, $6, $7, $8)",
+					   8, params);
+	result = atoi(PQgetvalue(res, 0, 0));
+	CLEARPGRES(res);
+
+	return result;
+}
+
+/*
+ * Format a byte count the same way pg_size_pretty() does.
+ */
+static char *
+size_pretty(double bytes, char *buf, size_t len)
+{
+	static const char *units[] = {"bytes", "kB", "MB", "GB", "TB"};
+	int			u = 0;
+
+	while (bytes >= 10 * 1024.0 && u < (int) lengthof(units) - 1)
+	{
+		bytes /= 1024.0;
+		u++;
+	}
+	snprintf(buf, len, "%.0f %s", bytes, units[u]);
+	return buf;
+}
+
+/*
+ * Take one sample of the size and write counters of all the tables to repack,
+ * whose oids are the second column of tables, with one row per table ordered
+ * by oid. Sampling them all at once lets --estimate wait for a single
+ * --estimate-interval whatever the number of tables. Returns NULL if the
+ * tables could not be sampled.
+ */
+static PGresult *
+estimate_snapshot(PGresult *tables)
+{
+	PGresult	   *res;
+	StringInfoData	oids;
+	const char	   *params[1];
+	int				i;
+
+	initStringInfo(&oids);
+	appendStringInfoChar(&oids, '{');
+	for (i = 0; i < PQntuples(tables); i++)
+		appendStringInfo(&oids, "%s%u", i > 0 ? "," : "", getoid(tables, i, 1));
+	appendStringInfoChar(&oids, '}');
+	params[0] = oids.data;
+
+	/* make sure we don't see the statistics cached by the last sample */
+	command("SELECT pg_catalog.pg_stat_clear_snapshot()", 0, NULL);
+	res = execute_elevel(
+		"SELECT c.oid, pg_catalog.pg_relation_size(c.oid),"
+		" CASE WHEN c.reltoastrelid = 0 THEN 0"
+		"  ELSE pg_catalog.pg_total_relation_size(c.reltoastrelid) END,"
+		" pg_catalog.pg_indexes_size(c.oid),"
+		" coalesce(s.n_live_tup, 0), coalesce(s.n_dead_tup, 0),"
+		" coalesce(s.n_tup_ins + s.n_tup_upd + s.n_tup_del, 0),"
+		" extract(epoch FROM pg_catalog.clock_timestamp())"
+		" FROM pg_catalog.pg_class c"
+		" LEFT JOIN pg_catalog.pg_stat_user_tables s ON s.relid = c.oid"
+		" WHERE c.oid = ANY($1::oid[]) ORDER BY c.oid",
+		1, params, DEBUG2);
+	termStringInfo(&oids);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		elog(WARNING, "could not sample the tables: %s",
+			 PQerrorMessage(connection));
+		CLEARPGRES(res);
+	}
+	return res;
+}
+
+/*
+ * Find the sample of a table in a snapshot of estimate_snapshot(). Returns
+ * false if the table was not sampled.
+ */
+static bool
+estimate_sample(PGresult *snapshot, Oid relid, double sample[7])
+{
+	int		lo = 0;
+	int		hi = snapshot ? PQntuples(snapshot) : 0;
+
+	while (lo < hi)
+	{
+		int		mid = lo + (hi - lo) / 2;
+		Oid		oid = getoid(snapshot, mid, 0);
+		int		i;
+
+		if (oid < relid)
+			lo = mid + 1;
+		else if (oid > relid)
+			hi = mid;
+		else
+		{
+			for (i = 0; i < 7; i++)
+				sample[i] = strtod(PQgetvalue(snapshot, mid, i + 1), NULL);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Report what repacking the table would cost without changing anything.
+ *
+ * The new size is projected from the fraction of live tuples; the durations
+ * are derived from the ESTIMATE_* throughput figures, and the rows logged by
+ * repack_trigger during the copy and the index build are projected from the
+ * write rate measured between the two snapshots of repack_one_database().
+ */
+static void
+estimate_table(const repack_table *table)
+{
+	double		before[7];
+	double		after[7];
+	double		heap, toast, idx, live, dead;
+	double		live_ratio, row_width, elapsed, write_rate;
+	double		new_heap, new_toast, new_idx;
+	double		copy_secs, index_secs, apply_secs;
+	double		log_rows, log_bytes;
+	char		buf[6][32];
+	const char *params[1];
+	PGresult   *res;
+	char	   *order_by;
+	bool		reorder;
+	char	   *reason;
+
+	if (!estimate_sample(estimate_before, table->target_oid, before) ||
+		!estimate_sample(estimate_after, table->target_oid, after))
+	{
+		elog(WARNING, "could not sample table \"%s\"", table->target_name);
+		return;
+	}
+
+	heap = after[0];
+	toast = after[1];
+	idx = after[2];
+	live = after[3];
+	dead = after[4];
+	elapsed = after[6] - before[6];
+	write_rate = elapsed > 0 ? (after[5] - before[5]) / elapsed : 0;
+	if (write_rate < 0)
+		write_rate = 0;		/* statistics were reset during the sample */
+
+	live_ratio = (live + dead > 0) ? live / (live + dead) : 1.0;
+	row_width = (live + dead > 0) ? heap / (live + dead) : 0;
+
+	new_heap = heap * live_ratio;
+	new_toast = toast * live_ratio;
+	new_idx = idx * live_ratio;
+
+	copy_secs = (heap + toast) / ESTIMATE_COPY_BYTES_PER_SEC;
+	index_secs = new_idx / ESTIMATE_INDEX_BYTES_PER_SEC;
+	if (jobs > 1)
+		index_secs /= jobs;
+
+	/* rows accumulated in the log table until the first apply_log() */
+	log_rows = write_rate * (copy_secs + index_secs);
+	log_bytes = log_rows * (row_width + ESTIMATE_LOG_ROW_OVERHEAD);
+
+	elog(INFO, "estimate for table \"%s\":", table->target_name);
+	elog(INFO, "  current size     : heap %s, toast %s, indexes %s",
+		 size_pretty(heap, buf[0], sizeof(buf[0])),
+		 size_pretty(toast, buf[1], sizeof(buf[1])),
+		 size_pretty(idx, buf[2], sizeof(buf[2])));
+	elog(INFO, "  new size         : heap %s, toast %s, indexes %s",
+		 size_pretty(new_heap, buf[0], sizeof(buf[0])),
+		 size_pretty(new_toast, buf[1], sizeof(buf[1])),
+		 size_pretty(new_idx, buf[2], sizeof(buf[2])));
+	elog(INFO, "  peak extra disk  : %s (new table and indexes, plus %s of log)",
+		 size_pretty(new_heap + new_toast + new_idx + log_bytes,
+					 buf[0], sizeof(buf[0])),
+		 size_pretty(log_bytes, buf[1], sizeof(buf[1])));
+	elog(INFO, "  WAL volume       : %s",
+		 size_pretty(new_heap + new_toast + new_idx + log_bytes +
+					 log_rows * row_width, buf[0], sizeof(buf[0])));
+	elog(INFO, "  write rate       : %.1f rows/s over %.0f s",
+		 write_rate, elapsed);
+	elog(INFO, "  copy time        : %.0f s", copy_secs);
+	elog(INFO, "  index build time : %.0f s", index_secs);
+	elog(INFO, "  log growth       : %.0f rows (%s) before the first apply",
+		 log_rows, size_pretty(log_bytes, buf[0], sizeof(buf[0])));
+
+	/*
+	 * The log only drains if we apply faster than the table is written;
+	 * each apply round has to replay what was logged during the previous
+	 * one, so the drain time is a geometric series.
+	 */
+	if (write_rate >= ESTIMATE_APPLY_ROWS_PER_SEC)
+	{
+		elog(INFO, "  apply time       : unbounded");
+		elog(WARNING, "table \"%s\" is written faster (%.0f rows/s) than the log can be applied (about %.0f rows/s), repack may never converge",
+			 table->target_name, write_rate, ESTIMATE_APPLY_ROWS_PER_SEC);
+	}
+	else
+	{
+		apply_secs = log_rows / (ESTIMATE_APPLY_ROWS_PER_SEC - write_rate);
+		elog(INFO, "  apply time       : %.0f s", apply_secs);
+		elog(INFO, "  convergence      : %s",
+			 write_rate < ESTIMATE_APPLY_ROWS_PER_SEC / 2 ? "likely" :
+			 "doubtful, consider a quieter period");
+	}
+
+	params[0] = utoa(table->target_oid, buf[0]);
+	res = execute("SELECT repack.advise_fillfactor($1)", 1, params);
+	elog(INFO, "  fillfactor       : %s advised", PQgetvalue(res, 0, 0));
+	CLEARPGRES(res);
+
+	if ((order_by = advise_order_by(table->target_oid, &reorder, &reason)) != NULL)
+	{
+		elog(INFO, "  order by         : %s advised (%s)%s", order_by, reason,
+			 reorder ? "" : ", already ordered");
+		free(order_by);
+		free(reason);
+	}
+	else
+		elog(INFO, "  order by         : no advice");
+}
+
+/*
+ * Get the best clustering key advised by repack.advise_order_by(), or NULL
+ * if no index of the table is worth it. Whether the rows need a reorder by
+ * the key is returned in reorder, and the reason of the advice in reason if
+ * not NULL. The results are malloc'ed.
+ */
+static char *
+advise_order_by(Oid target_oid, bool *reorder, char **reason)
+{
+	PGresult   *res;
+	const char *params[1];
+	char		buffer[12];
+	char	   *order_by = NULL;
+
+	params[0] = utoa(target_oid, buffer);
+	res = execute("SELECT order_by, reason, reorder FROM repack.advise_order_by($1)"
+				  " WHERE score > 0 LIMIT 1", 1, params);
+	if (PQntuples(res) > 0)
+	{
+		order_by = pgut_strdup(getstr(res, 0, 0));
+		*reorder = strcmp(getstr(res, 0, 2), "t") == 0;
+		if (reason)
+			*reason = pgut_strdup(getstr(res, 0, 1));
+	}
+	CLEARPGRES(res);
+
+	return order_by;
+}
+
+/*
+ * Is the table referenced by a foreign key?
+ */
+static bool
+is_referenced(Oid target_oid)
+{
+	PGresult   *res;
+	const char *params[1];
+	char		buffer[12];
+	bool		referenced;
+
+	params[0] = utoa(target_oid, buffer);
+	res = execute("SELECT 1 FROM pg_catalog.pg_constraint"
+				  " WHERE confrelid = $1 AND contype = 'f' LIMIT 1",
+				  1, params);
+	referenced = PQntuples(res) > 0;
+	CLEARPGRES(res);
+
+	return referenced;
+}
+
+/*
+ * Start loading, from conn2, the parts of the new table and indexes matching
+ * what is cached of the old ones. This runs in a savepoint, so that a failure
+ * doesn't abort the transaction holding the lock we need for the swap.
+ */
+static bool
+prewarm_start(const repack_table *table)
+{
+	const char *params[1];
+	char		buffer[12];
+
+	params[0] = utoa(table->target_oid, buffer);
+	pgut_command(conn2, "SAVEPOINT repack_prewarm", 0, NULL);
+	return pgut_send(conn2, "SELECT repack.prewarm($1)", 1, params);
+}
+
+/* Is the prewarm started by prewarm_start() still running? */
+static bool
+prewarm_busy(void)
+{
+	return PQconsumeInput(conn2) && PQisBusy(conn2);
+}
+
+/*
+ * Wait for the prewarm to complete and release its savepoint, or cancel it
+ * when we are bailing out and conn2 is going to be rolled back anyway.
+ */
+static void
+prewarm_finish(const repack_table *table, bool cancel)
+{
+	PGresult   *res;
+	bool		ok = true;
+
+	if (cancel)
+	{
+		PGcancel   *cancel_conn = PQgetCancel(conn2);
+		char		errbuf[256];
+
+		if (cancel_conn)
+		{
+			PQcancel(cancel_conn, errbuf, sizeof(errbuf));
+			PQfreeCancel(cancel_conn);
+		}
+	}
+
+	while ((res = PQgetResult(conn2)))
+	{
+		if (PQresultStatus(res) == PGRES_TUPLES_OK)
+			elog(DEBUG2, "prewarmed %s blocks for \"%s\"",
+				 PQgetvalue(res, 0, 0), table->target_name);
+		else
+		{
+			if (!cancel)
+				elog(WARNING, "prewarm failed for \"%s\": %s",
+					 table->target_name, PQerrorMessage(conn2));
+			ok = false;
+		}
+		CLEARPGRES(res);
+	}
+
+	if (!cancel)
+		pgut_command(conn2, ok ? "RELEASE SAVEPOINT repack_prewarm" :
+					 "ROLLBACK TO SAVEPOINT repack_prewarm", 0, NULL);
+}
+
+/*
+ * Check whether queries on the --standby still use the table. The replay of
+ * the swap's AccessExclusive lock would wait for them, holding up the whole
+ * standby, and cancel them after max_standby_streaming_delay. *since is the
+ * time of the first check; once it is older than --standby-wait we stop
+ * waiting and let the swap go ahead.
+ */
+static bool
+standby_busy(const repack_table *table, time_t *since)
+{
+	PGresult   *res;
+	const char *params[2];
+	char		buffer[12];
+	int			num;
+	const char *appname = getenv("PGAPPNAME");
+
+	params[0] = utoa(table->target_oid, buffer);
+	params[1] = PQdb(connection);
+	res = pgut_execute(standby_conn, SQL_STANDBY_CONFLICTS, 2, params);
+	num = PQntuples(res);
+
+	if (num > 0)
+	{
+		if (*since == 0)
+			*since = time(NULL);
+
+		if (time(NULL) - *since >= standby_wait)
+		{
+			elog(WARNING, "%d queries on the standby still use \"%s\" after %d seconds, swapping anyway. First PID: %s",
+				 num, table->target_name, standby_wait, PQgetvalue(res, 0, 0));
+			num = 0;
+		}
+		else if (!appname || strcmp(appname, "pg_regress") != 0)
+			elog(NOTICE, "Waiting for %d queries on the standby to finish. First PID: %s",
+				 num, PQgetvalue(res, 0, 0));
+	}
+
+	CLEARPGRES(res);
+	return num > 0;
+}
+
+/*
+ * Copy the rows of the table from the --standby into the temp table, for
+ * --copy-from-standby; the caller's transaction on the primary has created
+ * the temp table and started the log. The standby must have replayed the WAL
+ * up to the current position of the primary, so that its snapshot is not
+ * older than the one of the log. The changes seen by both, up to the last
+ * id of the log once the snapshot of the standby is taken, are applied
+ * again from the log idempotently. Returns false if the table has unique or
+ * exclusion indexes other than its key, which the idempotent replay could
+ * violate, or if the standby does not catch up within --standby-wait
+ * seconds.
+ */
+static bool
+standby_copy(repack_table *table, const char *orderby)
+{
+	PGresult   *res;
+	const char *params[2];
+	char		oidbuf[2][12];
+	char	   *lsn;
+	time_t		start = time(NULL);
+	bool		pg10 = PQserverVersion(connection) >= 100000;
+	StringInfoData	sql;
+	char	   *buf;
+	int			len;
+	int64		copied = 0;
+
+	/*
+	 * The replay of an INSERT or UPDATE over a newer copy deletes and
+	 * inserts the rows by key, out of their order: another unique index
+	 * could meet two rows that never existed at the same time.
+	 */
+	params[0] = utoa(table->target_oid, oidbuf[0]);
+	params[1] = utoa(table->pkid, oidbuf[1]);
+	res = execute("SELECT 1 FROM pg_catalog.pg_index"
+				  " WHERE indrelid = $1 AND indexrelid <> $2"
+				  " AND (indisunique OR indisexclusion) LIMIT 1", 2, params);
+	if (PQntuples(res) > 0)
+	{
+		elog(WARNING, "\"%s\" has unique or exclusion indexes besides its key, copying it from the primary",
+			 table->target_name);
+		CLEARPGRES(res);
+		return false;
+	}
+	CLEARPGRES(res);
+
+	res = execute(pg10 ? "SELECT pg_current_wal_lsn()" :
+				  "SELECT pg_current_xlog_location()", 0, NULL);
+	lsn = pgut_strdup(getstr(res, 0, 0));
+	CLEARPGRES(res);
 
-		{
-			if (ckey != NULL)
-			{
-				/* CLUSTER mode */
-				appendStringInfoString(&copy_sql, " ORDER BY ");
-				appendStringInfoString(&copy_sql, ckey);
-			}
+	params[0] = lsn;
+	for (;;)
+	{
+		bool		caught_up;
 
-			/* else, VACUUM FULL mode (non-clustered tables) */
-		}
-		else if (!orderby[0])
+		res = pgut_execute(standby_conn, pg10 ?
+			"SELECT coalesce(pg_wal_lsn_diff(pg_last_wal_replay_lsn(), $1) >= 0, false)" :
+			"SELECT coalesce(pg_xlog_location_diff(pg_last_xlog_replay_location(), $1) >= 0, false)",
+			1, params);
+		caught_up = strcmp(getstr(res, 0, 0), "t") == 0;
+		CLEARPGRES(res);
+		if (caught_up)
+			break;
+
+		if (time(NULL) - start >= standby_wait)
 		{
-			/* VACUUM FULL mode (for clustered tables too), do nothing */
+			elog(WARNING, "the standby has not replayed up to %s after %d seconds, copying \"%s\" from the primary",
+				 lsn, standby_wait, table->target_name);
+			free(lsn);
+			return false;
 		}
-		else
+		sleep(1);
+	}
+	free(lsn);
+
+	pgut_command(standby_conn, "BEGIN ISOLATION LEVEL REPEATABLE READ", 0, NULL);
+	pgut_command(standby_conn, "SELECT set_config('work_mem', current_setting('maintenance_work_mem'), true)", 0, NULL);
+	if (orderby && !orderby[0])
+		pgut_command(standby_conn, "SET LOCAL synchronize_seqscans = off", 0, NULL);
+	if (sort_tablespace)
+	{
+		params[0] = sort_tablespace;
+		pgut_command(standby_conn, "SELECT set_config('temp_tablespaces', $1, true)", 1, params);
+	}
+
+	/* copy_data is "INSERT INTO repack.table_<oid> SELECT ..." */
+	initStringInfo(&sql);
+	appendStringInfo(&sql, "INSERT INTO repack.table_%u ", table->target_oid);
+	Assert(strncmp(table->copy_data, sql.data, sql.len) == 0);
+	len = sql.len;
+	printfStringInfo(&sql, "COPY (%s) TO STDOUT", table->copy_data + len);
+	pgut_command(standby_conn, sql.data, 0, NULL);
+
+	/*
+	 * The snapshot of the standby is taken: the log rows inserted from now
+	 * on come from transactions it does not see.
+	 */
+	printfStringInfo(&sql, "SELECT coalesce(max(id), 0) FROM repack.log_%u",
+					 table->target_oid);
+	res = pgut_execute(conn2, sql.data, 0, NULL);
+	table->overlap_end = pgut_strdup(getstr(res, 0, 0));
+	CLEARPGRES(res);
+
+	printfStringInfo(&sql, "COPY repack.table_%u FROM STDIN", table->target_oid);
+	command(sql.data, 0, NULL);
+
+	while ((len = PQgetCopyData(standby_conn, &buf, 0)) > 0)
+	{
+		if (PQputCopyData(connection, buf, len) != 1)
+			elog(ERROR, "could not copy \"%s\": %s", table->target_name,
+				 PQerrorMessage(connection));
+		PQfreemem(buf);
+
+		/* check the pace every few megabytes */
+		copied += len;
+		if (copied >= 8 * 1024 * 1024)
 		{
-			/* User specified ORDER BY */
-			appendStringInfoString(&copy_sql, " ORDER BY ");
-			appendStringInfoString(&copy_sql, orderby);
+			throttle(conn2);
+			copied = 0;
 		}
-		table.copy_data = copy_sql.data;
+	}
+	if (len == -2)
+		elog(ERROR, "could not copy \"%s\" from the standby: %s",
+			 table->target_name, PQerrorMessage(standby_conn));
+	while ((res = PQgetResult(standby_conn)))
+	{
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			elog(ERROR, "could not copy \"%s\" from the standby: %s",
+				 table->target_name, PQerrorMessage(standby_conn));
+		CLEARPGRES(res);
+	}
 
-		repack_one_table(&table, orderby);
+	if (PQputCopyEnd(connection, NULL) != 1)
+		elog(ERROR, "could not copy \"%s\": %s", table->target_name,
+			 PQerrorMessage(connection));
+	while ((res = PQgetResult(connection)))
+	{
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			elog(ERROR, "could not copy \"%s\": %s", table->target_name,
+				 PQerrorMessage(connection));
+		CLEARPGRES(res);
 	}
-	ret = true;
 
-cleanup:
-	CLEARPGRES(res);
-	disconnect();
+	pgut_command(standby_conn, "COMMIT", 0, NULL);
 	termStringInfo(&sql);
-	free(params);
-	return ret;
+	return true;
 }
 
-static int
-apply_log(PGconn *conn, const repack_table *table, int count)
+/*
+ * Wait in repack.throttle() while the server writes WAL faster than
+ * --max-wal-rate or a standby lags behind more than --max-replay-lag, for
+ * the lag no longer than --max-throttle-wait.
+ */
+static void
+throttle(PGconn *conn)
 {
-	int			result;
-	PGresult   *res;
-	const char *params[6];
-	char		buffer[12];
+	const char *params[3];
+	char		ratebuffer[12];
+	char		lagbuffer[12];
+	char		waitbuffer[12];
 
-	params[0] = table->sql_peek;
-	params[1] = table->sql_insert;
-	params[2] = table->sql_delete;
-	params[3] = table->sql_update;
-	params[4] = table->sql_pop;
-	params[5] = utoa(count, buffer);
+	if (!max_wal_rate && !max_replay_lag)
+		return;
 
-	res = pgut_execute(conn,
-					   "SELECT repack.repack_apply($1, $2, $3, $4, $5, $6)",
-					   6, params);
-	result = atoi(PQgetvalue(res, 0, 0));
+	params[0] = utoa(max_wal_rate, ratebuffer);
+	params[1] = utoa(max_replay_lag, lagbuffer);
+	params[2] = utoa(max_throttle_wait, waitbuffer);
+	pgut_command(conn, "SELECT repack.throttle($1, $2, $3)", 3, params);
+}
+
+/*
+ * Check the log against --max-log-rows and --max-log-size. The writers are
+ * slowed down past --max-log-rows with --log-backpressure, in which case we
+ * only give up at twice as many rows. The size of the log never shrinks until
+ * it is dropped, so it is only ever a limit to give up at.
+ */
+static bool
+log_over_limit(const repack_table *table)
+{
+	PGresult	   *res;
+	StringInfoData	sql;
+	double			factor = log_backpressure ? 2 : 1;
+	double			rows;
+	double			size;
+	bool			over = true;
+
+	if (!max_log_rows && !max_log_size)
+		return false;
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql,
+		"SELECT coalesce(max(id) - min(id) + 1, 0),"
+		" pg_catalog.pg_total_relation_size('repack.log_%u')"
+		" FROM repack.log_%u", table->target_oid, table->target_oid);
+	res = execute(sql.data, 0, NULL);
+	rows = atof(PQgetvalue(res, 0, 0));
+	size = atof(PQgetvalue(res, 0, 1));
 	CLEARPGRES(res);
+	termStringInfo(&sql);
 
-	return result;
+	if (max_log_rows && rows > max_log_rows * factor)
+		elog(WARNING, "the log of \"%s\" holds %.0f rows, more than --max-log-rows allows; giving up",
+			 table->target_name, rows);
+	else if (max_log_size && size > max_log_size * 1048576.0)
+		elog(WARNING, "the log of \"%s\" takes %.0f MB, more than --max-log-size allows; giving up",
+			 table->target_name, size / 1048576.0);
+	else
+		over = false;
+
+	return over;
+}
+
+/*
+ * Run the ANALYZE commands queued by repack_one_table(), spread over the
+ * worker connections if the user asked for --jobs=...
+ */
+static void
+analyze_queued_tables(void)
+{
+	SimpleStringListCell   *cell;
+	SimpleStringListCell   *next;
+	PGresult			   *res;
+	int						num_workers = workers.num_workers;
+	int						num_active_workers = 0;
+	int						i;
+
+	if (analyze_queue.head == NULL)
+		return;
+
+	elog(DEBUG2, "---- analyze ----");
+
+	cell = analyze_queue.head;
+	if (num_workers <= 1)
+	{
+		for (; cell; cell = cell->next)
+			command(cell->val, 0, NULL);
+	}
+	else
+	{
+		/* Give one ANALYZE to each worker, then the next ones to the
+		 * workers as they become available.
+		 */
+		for (i = 0; i < num_workers && cell; i++, cell = cell->next)
+		{
+			pgut_send(workers.conns[i], cell->val, 0, NULL);
+			num_active_workers++;
+		}
+
+		while (num_active_workers > 0)
+		{
+			i = pgut_wait(num_workers, workers.conns, NULL);
+			if (i < 0)
+				break;
+
+			while ((res = PQgetResult(workers.conns[i])))
+			{
+				if (PQresultStatus(res) != PGRES_COMMAND_OK)
+					elog(WARNING, "Error with ANALYZE: %s",
+						 PQerrorMessage(workers.conns[i]));
+				CLEARPGRES(res);
+			}
+			num_active_workers--;
+
+			if (cell)
+			{
+				pgut_send(workers.conns[i], cell->val, 0, NULL);
+				num_active_workers++;
+				cell = cell->next;
+			}
+		}
+	}
+
+	for (cell = analyze_queue.head; cell; cell = next)
+	{
+		next = cell->next;
+		free(cell);
+	}
+	analyze_queue.head = analyze_queue.tail = NULL;
 }
 
 /*
@@ -1229,16 +2516,21 @@ static void
 repack_one_table(repack_table *table, const char *orderby)
 {
 	PGresult	   *res = NULL;
-	const char	   *params[3];
+	const char	   *params[4];
 	int				num;
 	char		   *vxid = NULL;
 	char			buffer[12];
 	StringInfoData	sql;
+	StringInfoData	storage;	/* new storage parameters, if any */
+	char		   *alter_compression = NULL;	/* for the original table */
 	bool            ret = false;
 	PGresult       *indexres = NULL;
-	const char     *indexparams[2];
+	const char     *indexparams[5];
 	char		    indexbuffer[12];
+	char		    fillbuffer[12];
 	int             j;
+	SimpleStringListCell *cell;
+	time_t			standby_since = 0;
 
 	/* appname will be "pg_repack" in normal use on 9.0+, or
 	 * "pg_regress" when run under `make installcheck`
@@ -1253,7 +2545,11 @@ repack_one_table(repack_table *table, const char *orderby)
 	 */
 	bool            table_init = false;
 
+	/* Whether conn2 is running repack.prewarm() */
+	bool            prewarming = false;
+
 	initStringInfo(&sql);
+	initStringInfo(&storage);
 
 	elog(INFO, "repacking table \"%s\"", table->target_name);
 
@@ -1281,6 +2577,14 @@ repack_one_table(repack_table *table, const char *orderby)
 	elog(DEBUG2, "sql_delete        : %s", table->sql_delete);
 	elog(DEBUG2, "sql_update        : %s", table->sql_update);
 	elog(DEBUG2, "sql_pop           : %s", table->sql_pop);
+	elog(DEBUG2, "sql_purge         : %s", table->sql_purge ?
+		 table->sql_purge : "(skipped)");
+
+	if (estimate)
+	{
+		estimate_table(table);
+		return;
+	}
 
 	if (dryrun)
 		return;
@@ -1314,6 +2618,9 @@ repack_one_table(repack_table *table, const char *orderby)
 
 	indexparams[0] = utoa(table->target_oid, indexbuffer);
 	indexparams[1] = moveidx ? tablespace : NULL;
+	indexparams[2] = index_tablespace_map;
+	indexparams[3] = index_fillfactor ? utoa(index_fillfactor, fillbuffer) : NULL;
+	indexparams[4] = deduplicate_items;
 
 	/* First, just display a warning message for any invalid indexes
 	 * which may be on the table (mostly to match the behavior of 1.1.8),
@@ -1338,9 +2645,11 @@ repack_one_table(repack_table *table, const char *orderby)
 
 	indexres = execute(
 		"SELECT indexrelid,"
-		" repack.repack_indexdef(indexrelid, indrelid, $2, FALSE) "
+		" repack.repack_indexdef(indexrelid, indrelid,"
+		"  coalesce(repack.get_index_tablespace(indexrelid, $3), $2), FALSE,"
+		"  repack.get_index_options(indexrelid, $4, $5)) "
 		" FROM pg_index WHERE indrelid = $1 AND indisvalid",
-		2, indexparams);
+		5, indexparams);
 
 	table->n_indexes = PQntuples(indexres);
 	table->indexes = pgut_malloc(table->n_indexes * sizeof(repack_index));
@@ -1387,8 +2696,25 @@ repack_one_table(repack_table *table, const char *orderby)
 
 	command(table->create_pktype, 0, NULL);
 	temp_obj_num++;
-	command(table->create_log, 0, NULL);
+	if (log_tablespace)
+	{
+		printfStringInfo(&sql, "SELECT repack.create_log_table(%u, $1)",
+						 table->target_oid);
+		params[0] = log_tablespace;
+		command(sql.data, 1, params);
+	}
+	else
+		command(table->create_log, 0, NULL);
 	temp_obj_num++;
+
+	/* Claim a slot in the shared capture ring if pg_repack is preloaded */
+	printfStringInfo(&sql, "SELECT repack.capture_start(%u)", table->target_oid);
+	res = execute(sql.data, 0, NULL);
+	table->capture = (strcmp(PQgetvalue(res, 0, 0), "t") == 0);
+	CLEARPGRES(res);
+	if (table->capture)
+		elog(DEBUG2, "capturing changes in shared memory");
+
 	command(table->create_trigger, 0, NULL);
 	temp_obj_num++;
 	command(table->enable_trigger, 0, NULL);
@@ -1496,6 +2822,11 @@ repack_one_table(repack_table *table, const char *orderby)
 	command("SELECT set_config('work_mem', current_setting('maintenance_work_mem'), true)", 0, NULL);
 	if (orderby && !orderby[0])
 		command("SET LOCAL synchronize_seqscans = off", 0, NULL);
+	if (sort_tablespace)
+	{
+		params[0] = sort_tablespace;
+		command("SELECT set_config('temp_tablespaces', $1, true)", 1, params);
+	}
 
 	/* Fetch an array of Virtual IDs of all transactions active right now.
 	 */
@@ -1513,6 +2844,16 @@ repack_one_table(repack_table *table, const char *orderby)
 	 */
 	command(table->delete_log, 0, NULL);
 
+	/* Changes still in the ring are treated like the log: those visible
+	 * to our snapshot are dropped, the rest are moved into the log.
+	 */
+	if (table->capture)
+	{
+		printfStringInfo(&sql, "SELECT repack.capture_drain(%u, true)",
+						 table->target_oid);
+		command(sql.data, 0, NULL);
+	}
+
 	/* We need to be able to obtain an AccessShare lock on the target table
 	 * for the create_table command to go through, so go ahead and obtain
 	 * the lock explicitly.
@@ -1534,10 +2875,60 @@ repack_one_table(repack_table *table, const char *orderby)
 	 */
 	params[0] = utoa(table->target_oid, buffer);
 	params[1] = table->dest_tablespace;
-	command(table->create_table, 2, params);
+	if (alter_column_spec || access_method)
+	{
+		params[2] = alter_column_spec ? alter_column_spec : "";
+		params[3] = access_method;
+		command("SELECT repack.create_table($1, $2, $3, $4)", 4, params);
+	}
+	else
+		command(table->create_table, 2, params);
 	if (table->alter_col_storage)
 		command(table->alter_col_storage, 0, NULL);
-	command(table->copy_data, 0, NULL);
+
+	/*
+	 * The new storage parameters and compression methods must be set before
+	 * the copy to shape the new heap. The swap only exchanges the files, so
+	 * they are also set on the original table at swap time.
+	 */
+	if (fillfactor && strcmp(fillfactor, "auto") == 0)
+	{
+		res = execute("SELECT repack.advise_fillfactor($1)", 1, params);
+		appendStringInfo(&storage, "fillfactor = %s", PQgetvalue(res, 0, 0));
+		CLEARPGRES(res);
+	}
+	else if (fillfactor)
+		appendStringInfo(&storage, "fillfactor = %s", fillfactor);
+	if (toast_tuple_target)
+		appendStringInfo(&storage, "%stoast_tuple_target = %d",
+						 storage.len > 0 ? ", " : "", toast_tuple_target);
+	if (storage.len > 0)
+	{
+		printfStringInfo(&sql, "ALTER TABLE repack.table_%u SET (%s)",
+						 table->target_oid, storage.data);
+		command(sql.data, 0, NULL);
+	}
+	if (compression_spec)
+	{
+		printfStringInfo(&sql, "repack.table_%u", table->target_oid);
+		params[1] = sql.data;
+		params[2] = compression_spec;
+		res = execute("SELECT repack.get_alter_col_compression($1, $2, $3)",
+					  3, params);
+		if (!PQgetisnull(res, 0, 0))
+			command(PQgetvalue(res, 0, 0), 0, NULL);
+		CLEARPGRES(res);
+
+		params[1] = table->target_name;
+		res = execute("SELECT repack.get_alter_col_compression($1, $2, $3)",
+					  3, params);
+		if (!PQgetisnull(res, 0, 0))
+			alter_compression = pgut_strdup(PQgetvalue(res, 0, 0));
+		CLEARPGRES(res);
+	}
+
+	if (!copy_from_standby || !standby_copy(table, orderby))
+		command(table->copy_data, 0, NULL);
 	temp_obj_num++;
 	printfStringInfo(&sql, "SELECT repack.disable_autovacuum('repack.table_%u')", table->target_oid);
 	if (table->drop_columns)
@@ -1556,13 +2947,48 @@ repack_one_table(repack_table *table, const char *orderby)
 	/*
 	 * 3. Create indexes on temp table.
 	 */
+	/* the sorts of the index builds spill to the --sort-tablespace too */
+	if (sort_tablespace)
+	{
+		params[0] = sort_tablespace;
+		command("SELECT set_config('temp_tablespaces', $1, false)", 1, params);
+		for (j = 0; j < workers.num_workers; j++)
+			pgut_command(workers.conns[j],
+						 "SELECT set_config('temp_tablespaces', $1, false)",
+						 1, params);
+	}
+
 	if (!rebuild_indexes(table))
 		goto cleanup;
 
+	/* the indexes of --add-index are built on the temp table too */
+	for (cell = add_index_list.head, j = 1; cell; cell = cell->next, j++)
+	{
+		params[0] = utoa(table->target_oid, buffer);
+		params[1] = cell->val;
+		params[2] = utoa(j, indexbuffer);
+		command("SELECT repack.create_add_index($1, $2, $3)", 3, params);
+	}
+
+	if (sort_tablespace)
+	{
+		command("RESET temp_tablespaces", 0, NULL);
+		for (j = 0; j < workers.num_workers; j++)
+			pgut_command(workers.conns[j], "RESET temp_tablespaces", 0, NULL);
+	}
+
 	/* don't clear indexres until after rebuild_indexes or bad things happen */
 	CLEARPGRES(indexres);
 	CLEARPGRES(res);
 
+	/*
+	 * Load the new table and indexes into shared buffers from conn2 while
+	 * we apply the log, so that the queries don't hit a cold cache after
+	 * the swap.
+	 */
+	if (prewarm)
+		prewarming = prewarm_start(table);
+
 	/*
 	 * 4. Apply log to temp table until no tuples are left in the log
 	 * and all of the old transactions are finished.
@@ -1571,6 +2997,13 @@ repack_one_table(repack_table *table, const char *orderby)
 	{
 		num = apply_log(connection, table, apply_count);
 
+		/* Pace the batches the same way as the initial copy. */
+		throttle(connection);
+
+		/* Give up before the log outgrows --max-log-rows or --max-log-size */
+		if (log_over_limit(table))
+			goto cleanup;
+
 		/* We'll keep applying tuples from the log table in batches
 		 * of apply_count, until applying a batch of tuples
 		 * (via LIMIT) results in our having applied
@@ -1607,8 +3040,24 @@ repack_one_table(repack_table *table, const char *orderby)
 		else
 		{
 			/* All old transactions are finished;
-			 * go to next step. */
+			 * go to next step once the prewarm is done too. */
 			CLEARPGRES(res);
+			if (prewarming)
+			{
+				if (prewarm_busy())
+				{
+					sleep(1);
+					continue;
+				}
+				prewarm_finish(table, false);
+				prewarming = false;
+				continue;	/* apply what was logged in the meantime */
+			}
+			if (standby_conn && standby_busy(table, &standby_since))
+			{
+				sleep(1);
+				continue;
+			}
 			break;
 		}
 	}
@@ -1644,6 +3093,38 @@ repack_one_table(repack_table *table, const char *orderby)
 
 	apply_log(conn2, table, 0);
 	params[0] = utoa(table->target_oid, buffer);
+	if (alter_column_spec)
+	{
+		/*
+		 * The new heap and indexes hold the new types; give them to the
+		 * catalog of the original table before swapping the files.
+		 */
+		params[1] = alter_column_spec;
+		pgut_command(conn2, "SELECT repack.alter_columns($1, $2)", 2, params);
+	}
+	for (cell = add_index_list.head, j = 1; cell; cell = cell->next, j++)
+	{
+		params[1] = cell->val;
+		params[2] = utoa(j, indexbuffer);
+		pgut_command(conn2, "SELECT repack.swap_add_index($1, $2, $3)", 3,
+					 params);
+	}
+	if (storage.len > 0)
+	{
+		printfStringInfo(&sql, "ALTER TABLE %s SET (%s)",
+						 table->target_name, storage.data);
+		pgut_command(conn2, sql.data, 0, NULL);
+	}
+	if (alter_compression)
+		pgut_command(conn2, alter_compression, 0, NULL);
+	if (index_fillfactor || deduplicate_items)
+	{
+		params[1] = index_fillfactor ? utoa(index_fillfactor, fillbuffer) : NULL;
+		params[2] = deduplicate_items;
+		pgut_command(conn2,
+			"SELECT repack.alter_index_options(indexrelid, $2, $3)"
+			" FROM pg_index WHERE indrelid = $1 AND indisvalid", 3, params);
+	}
 	pgut_command(conn2, "SELECT repack.repack_swap($1)", 1, params);
 	pgut_command(conn2, "COMMIT", 0, NULL);
 
@@ -1670,8 +3151,30 @@ repack_one_table(repack_table *table, const char *orderby)
 	 * 7. Analyze.
 	 * Note that cleanup hook has been already uninstalled here because analyze
 	 * is not an important operation; No clean up even if failed.
+	 * The altered columns lost their statistics with their old types, so the
+	 * whole table is analyzed with --alter-column.
 	 */
-	if (analyze)
+	if (analyze && keep_statistics && !alter_column_spec)
+	{
+		/*
+		 * The table keeps its OID, so its pg_statistic and extended
+		 * statistics survive the swap, and relpages and reltuples came with
+		 * the new heap. Only the correlation of the columns the rows were
+		 * ordered by has changed: queue an ANALYZE of these columns, run
+		 * once all the tables are repacked.
+		 */
+		params[0] = utoa(table->target_oid, buffer);
+		params[1] = table->order_by;
+		res = execute("SELECT repack.get_order_columns($1, $2)", 2, params);
+		if (!PQgetisnull(res, 0, 0))
+		{
+			printfStringInfo(&sql, "ANALYZE %s (%s)", table->target_name,
+							 PQgetvalue(res, 0, 0));
+			simple_string_list_append(&analyze_queue, sql.data);
+		}
+		CLEARPGRES(res);
+	}
+	else if (analyze)
 	{
 		elog(DEBUG2, "---- analyze ----");
 
@@ -1692,10 +3195,15 @@ repack_one_table(repack_table *table, const char *orderby)
 cleanup:
 	CLEARPGRES(res);
 	termStringInfo(&sql);
+	termStringInfo(&storage);
 	if (vxid)
 		free(vxid);
+	if (alter_compression)
+		free(alter_compression);
 
 	/* Rollback current transactions */
+	if (prewarming)
+		prewarm_finish(table, true);
 	pgut_rollback(connection);
 	pgut_rollback(conn2);
 
@@ -1706,6 +3214,89 @@ cleanup:
 		repack_cleanup(false, table);
 }
 
+/*
+ * Compact one table in place for --compact: move the rows of its last pages
+ * into the free space of its first pages, COMPACT_PAGES at a time, and let
+ * VACUUM truncate the emptied tail. There is no trigger, log or swap, so
+ * nothing to clean up if we stop halfway.
+ */
+static void
+compact_one_table(const repack_table *table)
+{
+	PGresult	   *res;
+	const char	   *params[4];
+	char			buffer[12];
+	char			pagesbuffer[12];
+	char		   *cutoff;
+	char		   *end;
+	StringInfoData	vacuum_sql;
+
+	elog(INFO, "compacting table \"%s\"", table->target_name);
+
+	if (dryrun)
+		return;
+
+	params[0] = utoa(table->target_oid, buffer);
+	if (!advisory_lock(connection, buffer))
+		return;
+
+	/* prune the dead rows and bring the free space map up to date */
+	initStringInfo(&vacuum_sql);
+	appendStringInfo(&vacuum_sql, "VACUUM %s", table->target_name);
+	command(vacuum_sql.data, 0, NULL);
+
+	res = execute("SELECT repack.compact_prepare($1),"
+				  " pg_catalog.pg_relation_size($1) /"
+				  " pg_catalog.current_setting('block_size')::bigint",
+				  1, params);
+	cutoff = pgut_strdup(getstr(res, 0, 0));
+	end = pgut_strdup(getstr(res, 0, 1));
+	CLEARPGRES(res);
+	elog(DEBUG2, "compact           : blocks %s to %s", cutoff, end);
+
+	if (strcmp(cutoff, "-1") == 0)
+		elog(WARNING, "relation \"%s\" has no column that can be updated in place, skipped with --compact",
+			 table->target_name);
+	else
+	{
+		/* the no-op updates don't fire the triggers of the table */
+		command("SET session_replication_role = replica", 0, NULL);
+		params[1] = cutoff;
+		params[3] = utoa(COMPACT_PAGES, pagesbuffer);
+		while (atof(end) > atof(cutoff))
+		{
+			params[2] = end;
+			res = execute("SELECT repack.compact_move($1, $2, $3, $4)", 4, params);
+			free(end);
+			end = pgut_strdup(getstr(res, 0, 0));
+			CLEARPGRES(res);
+
+			if (strcmp(end, "-1") == 0)
+			{
+				elog(WARNING, "could not move all the rows out of the tail of \"%s\", compacting it partially",
+					 table->target_name);
+				break;
+			}
+
+			/* Pace the batches the same way as a repack. */
+			throttle(connection);
+		}
+		command("RESET session_replication_role", 0, NULL);
+
+		/* truncate the emptied tail */
+		command(vacuum_sql.data, 0, NULL);
+	}
+
+	params[0] = REPACK_LOCK_PREFIX_STR;
+	params[1] = buffer;
+	command("SELECT pg_advisory_unlock($1, CAST(-2147483648 + $2::bigint AS integer))",
+			2, params);
+
+	free(cutoff);
+	free(end);
+	termStringInfo(&vacuum_sql);
+}
+
 /* Kill off any concurrent DDL (or any transaction attempting to take
  * an AccessExclusive lock) trying to run against our table if we want to
  * do. Note, we're killing these queries off *before* they are granted
@@ -2100,8 +3691,8 @@ repack_table_indexes(PGresult *index_details)
 	bool				ret = false;
 	PGresult			*res = NULL, *res2 = NULL;
 	StringInfoData		sql, sql_drop;
-	char				buffer[2][12];
-	const char			*create_idx, *schema_name, *table_name, *params[3];
+	char				buffer[3][12];
+	const char			*create_idx, *schema_name, *table_name, *params[6];
 	Oid					table, index;
 	int					i, num, num_repacked = 0;
 	bool                *repacked_indexes;
@@ -2112,6 +3703,9 @@ repack_table_indexes(PGresult *index_details)
 	table = getoid(index_details, 0, 3);
 	params[1] = utoa(table, buffer[1]);
 	params[2] = tablespace;
+	params[3] = index_tablespace_map;
+	params[4] = index_fillfactor ? utoa(index_fillfactor, buffer[2]) : NULL;
+	params[5] = deduplicate_items;
 	schema_name = getstr(index_details, 0, 5);
 	/* table_name is schema-qualified */
 	table_name = getstr(index_details, 0, 4);
@@ -2172,8 +3766,9 @@ repack_table_indexes(PGresult *index_details)
 				continue;
 
 			params[0] = utoa(index, buffer[0]);
-			res = execute("SELECT repack.repack_indexdef($1, $2, $3, true)", 3,
-						  params);
+			res = execute("SELECT repack.repack_indexdef($1, $2,"
+						  " coalesce(repack.get_index_tablespace($1, $4), $3), true,"
+						  " repack.get_index_options($1, $5, $6))", 6, params);
 
 			if (PQntuples(res) < 1)
 			{
@@ -2245,6 +3840,17 @@ repack_table_indexes(PGresult *index_details)
 		if (repacked_indexes[i])
 		{
 			params[0] = utoa(index, buffer[0]);
+			if (index_fillfactor || deduplicate_items)
+			{
+				const char *alter_params[3];
+
+				alter_params[0] = params[0];
+				alter_params[1] = params[4];
+				alter_params[2] = params[5];
+				pgut_command(connection,
+							 "SELECT repack.alter_index_options($1, $2, $3)",
+							 3, alter_params);
+			}
 			pgut_command(connection, "SELECT repack.repack_index_swap($1)", 1,
 						 params);
 		}
@@ -2305,6 +3911,21 @@ repack_all_indexes(char *errbuf, size_t errsize)
 	if (!is_requested_relation_exists(errbuf, errsize))
 		goto cleanup;
 
+	/* the sorts of the index builds spill to the --sort-tablespace */
+	if (sort_tablespace)
+	{
+		params[0] = sort_tablespace;
+		res = execute_elevel("SELECT set_config('temp_tablespaces', $1, false)",
+							 1, params, DEBUG2);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		{
+			if (errbuf)
+				snprintf(errbuf, errsize, "%s", PQerrorMessage(connection));
+			goto cleanup;
+		}
+		CLEARPGRES(res);
+	}
+
 	if (r_index.head)
 	{
 		appendStringInfoString(&sql,
@@ -2440,4 +4061,34 @@ pgut_help(bool details)
 	printf("      --error-on-invalid-index  don't repack when invalid index is found\n");
 	printf("      --apply-count             number of tuples to apply in one transaction during replay\n");
 	printf("      --switch-threshold        switch tables when that many tuples are left to catchup\n");
+	printf("      --estimate                predict size, WAL and duration of the repack and exit\n");
+	printf("      --estimate-interval=SECS  seconds to sample table write activity for --estimate\n");
+	printf("      --prewarm                 load the new table and indexes into cache before swap\n");
+	printf("      --keep-statistics         keep the planner statistics instead of a full ANALYZE\n");
+	printf("      --fillfactor=auto|NUM     fillfactor of the repacked table, auto to derive it from updates\n");
+	printf("      --toast-tuple-target=N    toast_tuple_target of the repacked table\n");
+	printf("      --compression=METHOD      compress the columns again with pglz or lz4, as [COL=]METHOD\n");
+	printf("      --index-fillfactor=NUM    fillfactor of the rebuilt indexes\n");
+	printf("      --deduplicate-items=BOOL  deduplicate_items of the rebuilt btree indexes\n");
+	printf("      --index-tablespace=MAP    move the indexes matching PATTERN to TBLSPC, as PATTERN=TBLSPC\n");
+	printf("      --order-by-curve=COLUMNS  order along a space-filling curve over the columns\n");
+	printf("      --curve=CURVE             zorder (default) or hilbert, for --order-by-curve\n");
+	printf("      --auto-order              order by the clustering key advised from the statistics\n");
+	printf("      --purge-where=PREDICATE   drop the rows matching PREDICATE while repacking\n");
+	printf("      --alter-column=COL:TYPE   change the type of the column COL to TYPE\n");
+	printf("      --add-index=STATEMENT     build the index of a CREATE INDEX statement too\n");
+	printf("      --access-method=AM        convert the tables to the table access method AM\n");
+	printf("      --log-tablespace=TBLSPC   create the log tables in TBLSPC\n");
+	printf("      --sort-tablespace=TBLSPC  spill the sorts of the copy and the index builds to TBLSPC\n");
+	printf("      --max-replay-lag=MB       pause while a standby replays more than MB behind\n");
+	printf("      --max-wal-rate=MB         limit the WAL written to MB per second\n");
+	printf("      --max-throttle-wait=SECS  wait for the standbys at most SECS seconds in a row\n");
+	printf("      --standby=CONNINFO        delay the swaps while queries on this hot standby use the table\n");
+	printf("      --standby-wait=SECS       longest delay of a swap for --standby (default 60)\n");
+	printf("      --copy-from-standby       read the initial copy of the tables from the --standby\n");
+	printf("      --coalesce-log            log only the net change of each row at commit\n");
+	printf("      --max-log-rows=NUM        give up when the log holds more than NUM rows\n");
+	printf("      --max-log-size=MB         give up when the log takes more than MB\n");
+	printf("      --log-backpressure=MS     delay the writers by MS per row past --max-log-rows instead\n");
+	printf("      --compact                 move the rows into the free space of the table in place\n");
 }
@@ -667,6 +667,7 @@ pgut_execute_elevel(PGconn* conn, const char *query, int nParams, const char **p
 		case PGRES_TUPLES_OK:
 		case PGRES_COMMAND_OK:
 		case PGRES_COPY_IN:
+		case PGRES_COPY_OUT:
 			break;
 		default:
 			ereport(elevel,
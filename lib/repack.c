@@ -8,11 +8,15 @@
 
 #include "postgres.h"
 
+#include <math.h>
 #include <unistd.h>
 
 #include "access/genam.h"
+#include "access/hash.h"
+#include "access/subtrans.h"
 #include "access/transam.h"
 #include "access/xact.h"
+#include "access/xlog.h"
 #include "catalog/dependency.h"
 #include "catalog/indexing.h"
 #include "catalog/namespace.h"
@@ -24,6 +28,15 @@
 #include "access/table.h"
 #endif
 
+/*
+ * RelationSetNewRelfilenode() takes the freeze horizons, and doesn't create
+ * the init fork of unlogged relations, before 12.0
+ */
+#if PG_VERSION_NUM < 120000
+#include "access/multixact.h"
+#include "catalog/heap.h"
+#endif
+
 /*
  * utils/rel.h no longer includes pg_am.h as of 9.6, so need to include
  * it explicitly.
@@ -45,14 +58,28 @@
 #include "commands/tablecmds.h"
 #include "commands/trigger.h"
 #include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/bufmgr.h"
+#include "storage/freespace.h"
+#include "storage/ipc.h"
 #include "storage/lmgr.h"
+#include "storage/lwlock.h"
+#include "storage/procarray.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/date.h"
 #include "utils/guc.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
 
 #include "pgut/pgut-spi.h"
 #include "pgut/pgut-be.h"
@@ -64,8 +91,16 @@
 #include "utils/ruleutils.h"
 #endif
 
+/* BMI2 PDEP is used for space-filling curve keys if the CPU has it */
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define USE_PDEP_WITH_RUNTIME_CHECK
+#endif
+
 PG_MODULE_MAGIC;
 
+void _PG_init(void);
+
 extern Datum PGUT_EXPORT repack_version(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_trigger(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_apply(PG_FUNCTION_ARGS);
@@ -76,6 +111,20 @@ extern Datum PGUT_EXPORT repack_drop(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_disable_autovacuum(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_index_swap(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_get_table_and_inheritors(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_detoast(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_curve_coord(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_zorder_key(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_hilbert_key(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_truncate(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_throttle(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_coalesce_trigger(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_capture_start(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_capture_drain(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_capture_limit(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_compact_prepare(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_compact_move(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_start(PG_FUNCTION_ARGS);
+extern void PGUT_EXPORT repack_worker_main(Datum main_arg);
 
 PG_FUNCTION_INFO_V1(repack_version);
 PG_FUNCTION_INFO_V1(repack_trigger);
@@ -87,12 +136,31 @@ PG_FUNCTION_INFO_V1(repack_drop);
 PG_FUNCTION_INFO_V1(repack_disable_autovacuum);
 PG_FUNCTION_INFO_V1(repack_index_swap);
 PG_FUNCTION_INFO_V1(repack_get_table_and_inheritors);
+PG_FUNCTION_INFO_V1(repack_detoast);
+PG_FUNCTION_INFO_V1(repack_curve_coord);
+PG_FUNCTION_INFO_V1(repack_zorder_key);
+PG_FUNCTION_INFO_V1(repack_hilbert_key);
+PG_FUNCTION_INFO_V1(repack_truncate);
+PG_FUNCTION_INFO_V1(repack_throttle);
+PG_FUNCTION_INFO_V1(repack_coalesce_trigger);
+PG_FUNCTION_INFO_V1(repack_capture_start);
+PG_FUNCTION_INFO_V1(repack_capture_drain);
+PG_FUNCTION_INFO_V1(repack_capture_limit);
+PG_FUNCTION_INFO_V1(repack_compact_prepare);
+PG_FUNCTION_INFO_V1(repack_compact_move);
+PG_FUNCTION_INFO_V1(repack_start);
 
 static void	repack_init(void);
 static SPIPlanPtr repack_prepare(const char *src, int nargs, Oid *argtypes);
 static const char *get_quoted_relname(Oid oid);
 static const char *get_quoted_nspname(Oid oid);
 static void swap_heap_or_index_files(Oid r1, Oid r2);
+static StringInfo log_insert_sql(Oid relid, Trigger *trigger, bool with_id);
+static bool ring_append(Oid relid, TriggerData *trigdata);
+static void ring_spill(Oid relid);
+static void ring_release(Oid relid);
+static int trigger_nkeys(Trigger *trigger);
+static void log_backpressure(Oid relid, Trigger *trigger);
 
 #define copy_tuple(tuple, desc) \
 	PointerGetDatum(SPI_returntuple((tuple), (desc)))
@@ -145,11 +213,13 @@ repack_version(PG_FUNCTION_ARGS)
  * @fn      Datum repack_trigger(PG_FUNCTION_ARGS)
  * @brief   Insert a operation log into log-table.
  *
- * repack_trigger(column1, ..., columnN)
+ * repack_trigger(column1, ..., columnN [, '', max_rows, delay])
  *
  * @param	column1		A column of the table in primary key/unique index.
  * ...
  * @param	columnN		A column of the table in primary key/unique index.
+ * @param	max_rows	Backlog of the log, in rows, past which writers wait.
+ * @param	delay		Wait of the writers for each row, in milliseconds.
  */
 Datum
 repack_trigger(PG_FUNCTION_ARGS)
@@ -175,6 +245,20 @@ repack_trigger(PG_FUNCTION_ARGS)
 
 	relid = RelationGetRelid(trigdata->tg_relation);
 
+	/* the change goes to shared memory if the table has room there */
+	if (ring_append(relid, trigdata))
+	{
+		/* the writers are slowed down all the same */
+		if (trigdata->tg_trigger->tgnargs > trigger_nkeys(trigdata->tg_trigger))
+		{
+			repack_init();
+			log_backpressure(relid, trigdata->tg_trigger);
+			SPI_finish();
+		}
+		PG_RETURN_POINTER(TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) ?
+						  trigdata->tg_newtuple : trigdata->tg_trigtuple);
+	}
+
 	/* retrieve parameters */
 	desc = RelationGetDescr(trigdata->tg_relation);
 	argtypes[0] = argtypes[1] = trigdata->tg_relation->rd_rel->reltype;
@@ -205,27 +289,499 @@ repack_trigger(PG_FUNCTION_ARGS)
 	}
 
 	/* prepare INSERT query */
-	sql = makeStringInfo();
-	appendStringInfo(sql, "INSERT INTO repack.log_%u(pk, row) "
-		"VALUES(CASE WHEN $1 IS NULL THEN NULL ELSE (ROW(", relid);
-	appendStringInfo(sql, "$1.%s", quote_identifier(trigdata->tg_trigger->tgargs[0]));
-	for (int i = 1; i < trigdata->tg_trigger->tgnargs; ++i)
-		appendStringInfo(sql, ", $1.%s", quote_identifier(trigdata->tg_trigger->tgargs[i]));
-	appendStringInfo(sql, ")::repack.pk_%u) END, $2)", relid);
+	sql = log_insert_sql(relid, trigdata->tg_trigger, false);
 
 	/* execute the INSERT query */
 	execute_with_args(SPI_OK_INSERT, sql->data, 2, argtypes, values, nulls);
 
+	log_backpressure(relid, trigdata->tg_trigger);
+
 	SPI_finish();
 
 	PG_RETURN_POINTER(tuple);
 }
 
+/*
+ * Number of the key columns among the arguments of the trigger. They may be
+ * followed by an empty string, which cannot be a column name, and the limit
+ * and the delay of log_backpressure().
+ */
+static int
+trigger_nkeys(Trigger *trigger)
+{
+	int		i;
+
+	for (i = 0; i < trigger->tgnargs; i++)
+	{
+		if (trigger->tgargs[i][0] == '\0')
+			break;
+	}
+	return i;
+}
+
+/*
+ * INSERT INTO the log table, of the old row $1 or NULL and the new row $2 or
+ * NULL, for the key columns given as the arguments of the trigger. The id is
+ * $3 if with_id, or the next one of the log otherwise.
+ */
+static StringInfo
+log_insert_sql(Oid relid, Trigger *trigger, bool with_id)
+{
+	StringInfo	sql = makeStringInfo();
+	int			nkeys = trigger_nkeys(trigger);
+
+	appendStringInfo(sql, "INSERT INTO repack.log_%u(%spk, row) "
+		"VALUES(%sCASE WHEN $1 IS NULL THEN NULL ELSE (ROW(", relid,
+		with_id ? "id, " : "", with_id ? "$3, " : "");
+	appendStringInfo(sql, "$1.%s", quote_identifier(trigger->tgargs[0]));
+	for (int i = 1; i < nkeys; ++i)
+		appendStringInfo(sql, ", $1.%s", quote_identifier(trigger->tgargs[i]));
+	appendStringInfo(sql, ")::repack.pk_%u) END, $2)", relid);
+
+	return sql;
+}
+
+/*
+ * Change coalescing for repack_coalesce_trigger(). The changes made by a
+ * transaction are kept in backend memory, one entry per key with the row
+ * before the transaction and the latest one, and only the net change of
+ * each key is written to the log, at commit. Each subtransaction keeps its
+ * own changes, merged into its parent's at subcommit and thrown away at
+ * subabort, as the rows it wrote to the log would be.
+ */
+typedef struct CoalesceRel
+{
+	Oid			relid;
+	Oid			owner;		/* to write the log as */
+	Oid			rowtype;
+	StringInfo	sql;		/* log_insert_sql() */
+	bool		split;		/* write updates as a DELETE and an INSERT */
+} CoalesceRel;
+
+typedef struct CoalesceKey
+{
+	Oid			relid;
+	char	   *pk;			/* text of the key columns */
+} CoalesceKey;
+
+typedef struct CoalesceEntry
+{
+	CoalesceKey	key;		/* hash key, must be first */
+	CoalesceRel *rel;
+	Datum		old;		/* row before the changes, or 0 if none */
+	Datum		cur;		/* latest row, or 0 if deleted */
+} CoalesceEntry;
+
+typedef struct CoalesceLevel
+{
+	SubTransactionId subid;
+	HTAB	   *changes;	/* of CoalesceEntry */
+	struct CoalesceLevel *parent;
+} CoalesceLevel;
+
+/* write the changes of the transaction out when there are so many keys */
+#define COALESCE_MAX_KEYS	100000
+
+static MemoryContext coalesce_cxt = NULL;
+static CoalesceLevel *coalesce_level = NULL;
+static List *coalesce_rels = NIL;
+static bool coalesce_registered = false;
+
+static uint32
+coalesce_hash(const void *key, Size keysize)
+{
+	const CoalesceKey *k = (const CoalesceKey *) key;
+
+	return DatumGetUInt32(hash_uint32(k->relid)) ^
+		DatumGetUInt32(hash_any((const unsigned char *) k->pk, strlen(k->pk)));
+}
+
+static int
+coalesce_match(const void *key1, const void *key2, Size keysize)
+{
+	const CoalesceKey *k1 = (const CoalesceKey *) key1;
+	const CoalesceKey *k2 = (const CoalesceKey *) key2;
+
+	if (k1->relid != k2->relid)
+		return 1;
+	return strcmp(k1->pk, k2->pk);
+}
+
+/* the key columns of the tuple as text, unambiguously */
+static char *
+coalesce_key(Trigger *trigger, TupleDesc desc, HeapTuple tuple)
+{
+	StringInfoData	key;
+
+	initStringInfo(&key);
+	for (int i = 0; i < trigger->tgnargs; i++)
+	{
+		int		attnum = SPI_fnumber(desc, trigger->tgargs[i]);
+		char   *value;
+
+		if (attnum <= 0)
+			elog(ERROR, "repack_coalesce_trigger: column \"%s\" not found",
+				 trigger->tgargs[i]);
+		value = SPI_getvalue(tuple, desc, attnum);
+		if (value == NULL)
+			appendStringInfoChar(&key, 'N');
+		else
+		{
+			appendStringInfo(&key, "%d:%s", (int) strlen(value), value);
+			pfree(value);
+		}
+	}
+
+	return key.data;
+}
+
+static CoalesceRel *
+coalesce_get_rel(TriggerData *trigdata)
+{
+	Relation		rel = trigdata->tg_relation;
+	Oid				relid = RelationGetRelid(rel);
+	CoalesceRel	   *crel;
+	List		   *indexes;
+	ListCell	   *cell;
+	int				nunique = 0;
+	MemoryContext	oldcxt;
+
+	foreach(cell, coalesce_rels)
+	{
+		crel = (CoalesceRel *) lfirst(cell);
+		if (crel->relid == relid)
+			return crel;
+	}
+
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+
+	crel = palloc(sizeof(CoalesceRel));
+	crel->relid = relid;
+	crel->owner = GetUserId();	/* the trigger is SECURITY DEFINER */
+	crel->rowtype = rel->rd_rel->reltype;
+	crel->sql = log_insert_sql(relid, trigdata->tg_trigger, false);
+
+	/*
+	 * Updates of a key cannot be replayed one by one when another unique
+	 * index could see a value still held by a row updated later on: write
+	 * all the deletions before all the insertions then.
+	 */
+	indexes = RelationGetIndexList(rel);
+	foreach(cell, indexes)
+	{
+		Relation	index = index_open(lfirst_oid(cell), AccessShareLock);
+
+		if (index->rd_index->indisunique || index->rd_index->indisexclusion)
+			nunique++;
+		index_close(index, AccessShareLock);
+	}
+	list_free(indexes);
+	crel->split = nunique > 1;
+
+	coalesce_rels = lappend(coalesce_rels, crel);
+	MemoryContextSwitchTo(oldcxt);
+
+	return crel;
+}
+
+/* record the change of a key from the row before to the row after, if any */
+static void
+coalesce_change(CoalesceRel *crel, char *pk, TupleDesc desc,
+				HeapTuple before, HeapTuple after)
+{
+	CoalesceKey		key;
+	CoalesceEntry  *entry;
+	bool			found;
+
+	key.relid = crel->relid;
+	key.pk = pk;
+	entry = hash_search(coalesce_level->changes, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->rel = crel;
+		entry->old = before ? heap_copy_tuple_as_datum(before, desc) : (Datum) 0;
+	}
+	else
+	{
+		pfree(pk);
+		if (entry->cur)
+			pfree(DatumGetPointer(entry->cur));
+	}
+	entry->cur = after ? heap_copy_tuple_as_datum(after, desc) : (Datum) 0;
+}
+
+static void
+coalesce_free(CoalesceLevel *level)
+{
+	HASH_SEQ_STATUS	status;
+	CoalesceEntry  *entry;
+
+	hash_seq_init(&status, level->changes);
+	while ((entry = (CoalesceEntry *) hash_seq_search(&status)) != NULL)
+	{
+		pfree(entry->key.pk);
+		if (entry->old)
+			pfree(DatumGetPointer(entry->old));
+		if (entry->cur)
+			pfree(DatumGetPointer(entry->cur));
+	}
+	hash_destroy(level->changes);
+	pfree(level);
+}
+
+/*
+ * Write the net changes of the transaction to the log: the deletions first,
+ * then the updates, then the insertions.
+ */
+static void
+coalesce_flush(void)
+{
+	CoalesceLevel  *level = coalesce_level;
+	HASH_SEQ_STATUS	status;
+	CoalesceEntry  *entry;
+	Oid				save_userid;
+	int				save_sec_context;
+
+	Assert(level->parent == NULL);
+	coalesce_level = NULL;
+
+	repack_init();
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+
+	for (int pass = 0; pass < 3; pass++)
+	{
+		hash_seq_init(&status, level->changes);
+		while ((entry = (CoalesceEntry *) hash_seq_search(&status)) != NULL)
+		{
+			CoalesceRel *crel = entry->rel;
+			Oid			argtypes[2];
+			Datum		values[2];
+			bool		nulls[2];
+
+			values[0] = entry->old;
+			values[1] = entry->cur;
+			switch (pass)
+			{
+				case 0:		/* DELETE */
+					if (!entry->old || (entry->cur && !crel->split))
+						continue;
+					values[1] = (Datum) 0;
+					break;
+				case 1:		/* UPDATE */
+					if (!entry->old || !entry->cur || crel->split)
+						continue;
+					break;
+				default:	/* INSERT */
+					if (!entry->cur || (entry->old && !crel->split))
+						continue;
+					values[0] = (Datum) 0;
+					break;
+			}
+			nulls[0] = values[0] == (Datum) 0;
+			nulls[1] = values[1] == (Datum) 0;
+			argtypes[0] = argtypes[1] = crel->rowtype;
+
+			SetUserIdAndSecContext(crel->owner,
+								   save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+			execute_with_args(SPI_OK_INSERT, crel->sql->data, 2, argtypes,
+							  values, nulls);
+			SetUserIdAndSecContext(save_userid, save_sec_context);
+		}
+	}
+
+	SPI_finish();
+	coalesce_free(level);
+}
+
+static void
+coalesce_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+		case XACT_EVENT_PRE_PREPARE:
+			if (coalesce_level)
+				coalesce_flush();
+			break;
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			/* the memory went away with TopTransactionContext */
+			coalesce_cxt = NULL;
+			coalesce_level = NULL;
+			coalesce_rels = NIL;
+			break;
+		default:
+			break;
+	}
+}
+
+static void
+coalesce_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						  SubTransactionId parentSubid, void *arg)
+{
+	CoalesceLevel  *level = coalesce_level;
+	CoalesceLevel  *parent;
+	HASH_SEQ_STATUS	status;
+	CoalesceEntry  *entry;
+
+	if (level == NULL || level->subid != mySubid)
+		return;
+
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+	{
+		coalesce_level = level->parent;
+		coalesce_free(level);
+	}
+	else if (event == SUBXACT_EVENT_COMMIT_SUB)
+	{
+		parent = level->parent;
+		if (parent == NULL || parent->subid != parentSubid)
+		{
+			/* the parent has no changes of its own yet */
+			level->subid = parentSubid;
+			return;
+		}
+
+		hash_seq_init(&status, level->changes);
+		while ((entry = (CoalesceEntry *) hash_seq_search(&status)) != NULL)
+		{
+			CoalesceEntry  *into;
+			bool			found;
+
+			into = hash_search(parent->changes, &entry->key, HASH_ENTER, &found);
+			if (!found)
+			{
+				*into = *entry;
+				continue;
+			}
+			pfree(entry->key.pk);
+			if (entry->old)
+				pfree(DatumGetPointer(entry->old));
+			if (into->cur)
+				pfree(DatumGetPointer(into->cur));
+			into->cur = entry->cur;
+		}
+		hash_destroy(level->changes);
+		pfree(level);
+		coalesce_level = parent;
+	}
+}
+
+/**
+ * @fn      Datum repack_coalesce_trigger(PG_FUNCTION_ARGS)
+ * @brief   Record a change in backend memory, to be logged at commit.
+ *
+ * repack_coalesce_trigger(column1, ..., columnN)
+ *
+ * @param	column1		A column of the table in primary key/unique index.
+ * ...
+ * @param	columnN		A column of the table in primary key/unique index.
+ */
+Datum
+repack_coalesce_trigger(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = (TriggerData *) fcinfo->context;
+	TupleDesc		desc;
+	HeapTuple		oldtup = NULL;
+	HeapTuple		newtup = NULL;
+	char		   *oldpk = NULL;
+	char		   *newpk = NULL;
+	CoalesceRel	   *crel;
+	SubTransactionId subid = GetCurrentSubTransactionId();
+	MemoryContext	oldcxt;
+
+	/* authority check */
+	must_be_superuser("repack_coalesce_trigger");
+
+	/* make sure it's called as a trigger at all */
+	if (!CALLED_AS_TRIGGER(fcinfo) ||
+		!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+		!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event) ||
+		trigdata->tg_trigger->tgnargs < 1)
+		elog(ERROR, "repack_coalesce_trigger: invalid trigger call");
+
+	desc = RelationGetDescr(trigdata->tg_relation);
+	if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+		newtup = trigdata->tg_trigtuple;
+	else if (TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+		oldtup = trigdata->tg_trigtuple;
+	else
+	{
+		oldtup = trigdata->tg_trigtuple;
+		newtup = trigdata->tg_newtuple;
+	}
+
+	if (!coalesce_registered)
+	{
+		RegisterXactCallback(coalesce_xact_callback, NULL);
+		RegisterSubXactCallback(coalesce_subxact_callback, NULL);
+		coalesce_registered = true;
+	}
+	if (coalesce_cxt == NULL)
+		coalesce_cxt = AllocSetContextCreate(TopTransactionContext,
+											 "repack coalesce",
+											 ALLOCSET_DEFAULT_MINSIZE,
+											 ALLOCSET_DEFAULT_INITSIZE,
+											 ALLOCSET_DEFAULT_MAXSIZE);
+	crel = coalesce_get_rel(trigdata);
+
+	oldcxt = MemoryContextSwitchTo(coalesce_cxt);
+
+	if (coalesce_level == NULL || coalesce_level->subid != subid)
+	{
+		CoalesceLevel  *level = palloc(sizeof(CoalesceLevel));
+		HASHCTL			ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(CoalesceKey);
+		ctl.entrysize = sizeof(CoalesceEntry);
+		ctl.hash = coalesce_hash;
+		ctl.match = coalesce_match;
+		ctl.hcxt = coalesce_cxt;
+		level->subid = subid;
+		level->changes = hash_create("repack coalesce", 1024, &ctl,
+						HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+		level->parent = coalesce_level;
+		coalesce_level = level;
+	}
+
+	if (oldtup)
+		oldpk = coalesce_key(trigdata->tg_trigger, desc, oldtup);
+	if (newtup)
+		newpk = coalesce_key(trigdata->tg_trigger, desc, newtup);
+
+	if (oldpk && newpk && strcmp(oldpk, newpk) == 0)
+	{
+		pfree(newpk);
+		coalesce_change(crel, oldpk, desc, oldtup, newtup);
+	}
+	else
+	{
+		/* a changed key deletes the old one and inserts the new one */
+		if (oldpk)
+			coalesce_change(crel, oldpk, desc, oldtup, NULL);
+		if (newpk)
+			coalesce_change(crel, newpk, desc, NULL, newtup);
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	/* keep the memory bounded outside of subtransactions */
+	if (coalesce_level->parent == NULL &&
+		coalesce_level->subid == TopSubTransactionId &&
+		hash_get_num_entries(coalesce_level->changes) >= COALESCE_MAX_KEYS)
+		coalesce_flush();
+
+	PG_RETURN_POINTER(newtup ? newtup : oldtup);
+}
+
 /**
  * @fn      Datum repack_apply(PG_FUNCTION_ARGS)
  * @brief   Apply operations in log table into temp table.
  *
- * repack_apply(sql_peek, sql_insert, sql_delete, sql_update, sql_pop,  count)
+ * repack_apply(sql_peek, sql_insert, sql_delete, sql_update, sql_pop,  count
+ *				[, sql_purge [, idempotent_until]])
  *
  * @param	sql_peek	SQL to pop tuple from log table.
  * @param	sql_insert	SQL to insert into temp table.
@@ -233,6 +789,14 @@ repack_trigger(PG_FUNCTION_ARGS)
  * @param	sql_update	SQL to update temp table.
  * @param	sql_pop	SQL to bulk-delete tuples from log table.
  * @param	count		Max number of operations, or no count iff <=0.
+ * @param	sql_purge	SQL returning a row iff the row given is purged, or
+ *						NULL. Purged rows are not inserted, and updates
+ *						to a purged row delete it.
+ * @param	idempotent_until	Last id of the log whose changes the temp
+ *						table may already hold, or 0. These are replayed
+ *						idempotently: an INSERT replaces any row with the
+ *						same key, and an UPDATE deletes both keys before
+ *						inserting.
  * @retval				Number of performed operations.
  */
 Datum
@@ -246,11 +810,17 @@ repack_apply(PG_FUNCTION_ARGS)
 	const char *sql_update = PG_GETARG_CSTRING(3);
 	/* sql_pop, the fourth arg, will be used in the loop below */
 	int32		count = PG_GETARG_INT32(5);
+	const char *sql_purge = (PG_NARGS() > 6 && !PG_ARGISNULL(6)) ?
+		PG_GETARG_CSTRING(6) : NULL;
+	int64		idempotent_until = (PG_NARGS() > 7 && !PG_ARGISNULL(7)) ?
+		PG_GETARG_INT64(7) : 0;
 
 	SPIPlanPtr		plan_peek = NULL;
 	SPIPlanPtr		plan_insert = NULL;
 	SPIPlanPtr		plan_delete = NULL;
 	SPIPlanPtr		plan_update = NULL;
+	SPIPlanPtr		plan_purge = NULL;
+	SPIPlanPtr		plan_delete_row = NULL;
 	uint32			n, i;
 	Oid				argtypes_peek[1] = { INT4OID };
 	Datum			values_peek[1];
@@ -302,6 +872,7 @@ repack_apply(PG_FUNCTION_ARGS)
 		{
 			HeapTuple	tuple;
 			char *pkid;
+			bool		purged;
 
 			tuple = tuptable->vals[i];
 			values[0] = SPI_getbinval(tuple, desc, 1, &nulls[0]);
@@ -311,7 +882,49 @@ repack_apply(PG_FUNCTION_ARGS)
 			pkid = SPI_getvalue(tuple, desc, 1);
 			Assert(pkid != NULL);
 
-			if (nulls[1])
+			/* Is the new row purged? Then it must not be in the temp table. */
+			if (sql_purge && !nulls[2])
+			{
+				if (plan_purge == NULL)
+					plan_purge = repack_prepare(sql_purge, 1, &argtypes[2]);
+				execute_plan(SPI_OK_SELECT, plan_purge, &values[2], " ");
+				purged = SPI_processed > 0;
+				SPI_freetuptable(SPI_tuptable);
+				if (purged)
+				{
+					if (!nulls[1])
+					{
+						/* UPDATE to a purged row: DELETE */
+						if (plan_delete == NULL)
+							plan_delete = repack_prepare(sql_delete, 1, &argtypes[1]);
+						execute_plan(SPI_OK_DELETE, plan_delete, &values[1], " ");
+					}
+					/* else INSERT of a purged row: skip */
+					goto next;
+				}
+			}
+
+			if (!nulls[2] && DatumGetInt64(values[0]) <= idempotent_until)
+			{
+				/*
+				 * INSERT or UPDATE over a copy that may already hold the old
+				 * or the new row: DELETE both keys, then INSERT. sql_delete
+				 * only reads the key columns, so it takes the row as well.
+				 */
+				if (!nulls[1])
+				{
+					if (plan_delete == NULL)
+						plan_delete = repack_prepare(sql_delete, 1, &argtypes[1]);
+					execute_plan(SPI_OK_DELETE, plan_delete, &values[1], " ");
+				}
+				if (plan_delete_row == NULL)
+					plan_delete_row = repack_prepare(sql_delete, 1, &argtypes[2]);
+				execute_plan(SPI_OK_DELETE, plan_delete_row, &values[2], " ");
+				if (plan_insert == NULL)
+					plan_insert = repack_prepare(sql_insert, 1, &argtypes[2]);
+				execute_plan(SPI_OK_INSERT, plan_insert, &values[2], " ");
+			}
+			else if (nulls[1])
 			{
 				/* INSERT */
 				if (plan_insert == NULL)
@@ -331,8 +944,20 @@ repack_apply(PG_FUNCTION_ARGS)
 				if (plan_update == NULL)
 					plan_update = repack_prepare(sql_update, 2, &argtypes[1]);
 				execute_plan(SPI_OK_UPDATE, plan_update, &values[1], (nulls[1] ? "n" : " "));
+
+				/*
+				 * The old row was purged by the copy, the new one is not:
+				 * INSERT it instead.
+				 */
+				if (sql_purge && SPI_processed == 0)
+				{
+					if (plan_insert == NULL)
+						plan_insert = repack_prepare(sql_insert, 1, &argtypes[2]);
+					execute_plan(SPI_OK_INSERT, plan_insert, &values[2], " ");
+				}
 			}
 
+next:
 			/* Add the primary key ID of each row from the log
 			 * table we have processed so far to this
 			 * DELETE ... IN (...) query string, so we
@@ -773,6 +1398,8 @@ repack_get_order_by(PG_FUNCTION_ARGS)
  * @param	table		Oid of table of the index.
  * @param	tablespace	Namespace for the index. If NULL keep the original.
  * @param   boolean		Whether to use CONCURRENTLY when creating the index.
+ * @param	options		Storage parameters replacing the original ones, if
+ *						given and not NULL.
  * @retval			Create index DDL for temp table.
  */
 Datum
@@ -781,6 +1408,7 @@ repack_indexdef(PG_FUNCTION_ARGS)
 	Oid				index;
 	Oid				table;
 	Name			tablespace = NULL;
+	char		   *options = NULL;
 	IndexDef		stmt;
 	StringInfoData	str;
 	bool			concurrent_index = PG_GETARG_BOOL(3);
@@ -794,8 +1422,24 @@ repack_indexdef(PG_FUNCTION_ARGS)
 	if (!PG_ARGISNULL(2))
 		tablespace = PG_GETARG_NAME(2);
 
+	if (PG_NARGS() > 4 && !PG_ARGISNULL(4))
+		options = text_to_cstring(PG_GETARG_TEXT_PP(4));
+
 	parse_indexdef(&stmt, index, table);
 
+	/* cut the WITH clause out of the options, it's the last of them */
+	if (options)
+	{
+		char   *with = strstr(stmt.options, " WITH (");
+
+		if (with)
+		{
+			*with = '\0';
+			if (skip_until(index, with + 7, ')') == NULL)
+				parse_error(index);
+		}
+	}
+
 	initStringInfo(&str);
 	if (concurrent_index)
 		appendStringInfo(&str, "%s CONCURRENTLY index_%u ON %s USING %s (%s)%s",
@@ -804,6 +1448,9 @@ repack_indexdef(PG_FUNCTION_ARGS)
 		appendStringInfo(&str, "%s index_%u ON repack.table_%u USING %s (%s)%s",
 			stmt.create, index, table, stmt.type, stmt.columns, stmt.options);
 
+	if (options)
+		appendStringInfo(&str, " WITH (%s)", options);
+
 	/* specify the new tablespace or the original one if any */
 	if (tablespace || stmt.tablespace)
 		appendStringInfo(&str, " TABLESPACE %s",
@@ -1097,6 +1744,9 @@ repack_drop(PG_FUNCTION_ARGS)
 			nspname, relname);
 	}
 
+	/* stop capturing the changes in shared memory, if it did */
+	ring_release(oid);
+
 	/* drop log table: must be done before dropping the pk type,
 	 * since the log table is dependent on the pk type. (That's
 	 * why we check numobj > 1 here.)
@@ -1148,6 +1798,54 @@ repack_drop(PG_FUNCTION_ARGS)
 	PG_RETURN_VOID();
 }
 
+/**
+ * @fn      Datum repack_truncate(PG_FUNCTION_ARGS)
+ * @brief   Give a new, empty heap file to the table.
+ *
+ * repack_truncate(oid)
+ *
+ * Unlike TRUNCATE, this checks no foreign key and fires no trigger, and
+ * leaves the toast table and the indexes alone: the caller swaps them all
+ * with the ones of repack.table_<oid> afterwards.
+ *
+ * @param	oid		Oid of target table.
+ * @retval			None.
+ */
+Datum
+repack_truncate(PG_FUNCTION_ARGS)
+{
+	Oid			oid = PG_GETARG_OID(0);
+	Relation	rel;
+
+	/* authority check */
+	must_be_superuser("repack_truncate");
+
+#if PG_VERSION_NUM >= 120000
+	rel = table_open(oid, AccessExclusiveLock);
+#else
+	rel = heap_open(oid, AccessExclusiveLock);
+#endif
+
+#if PG_VERSION_NUM >= 160000
+	RelationSetNewRelfilenumber(rel, rel->rd_rel->relpersistence);
+#elif PG_VERSION_NUM >= 120000
+	RelationSetNewRelfilenode(rel, rel->rd_rel->relpersistence);
+#else
+	RelationSetNewRelfilenode(rel, rel->rd_rel->relpersistence,
+							  RecentXmin, GetOldestMultiXactId());
+	if (rel->rd_rel->relpersistence == RELPERSISTENCE_UNLOGGED)
+		heap_create_init_fork(rel);
+#endif
+
+#if PG_VERSION_NUM >= 120000
+	table_close(rel, NoLock);
+#else
+	heap_close(rel, NoLock);
+#endif
+
+	PG_RETURN_VOID();
+}
+
 Datum
 repack_disable_autovacuum(PG_FUNCTION_ARGS)
 {
@@ -1201,7 +1899,7 @@ get_quoted_nspname(Oid oid)
 
 /*
  * This is a copy of swap_relation_files in cluster.c, but it also swaps
- * relfrozenxid.
+ * relfrozenxid, and the table access method.
  */
 static void
 swap_heap_or_index_files(Oid r1, Oid r2)
@@ -1233,6 +1931,14 @@ swap_heap_or_index_files(Oid r1, Oid r2)
 
 	Assert(relform1->relkind == relform2->relkind);
 
+	/*
+	 * The init fork of an unlogged relation goes with its relfilenode, so
+	 * the files only fit a relation of the same persistence.
+	 */
+	if (relform1->relpersistence != relform2->relpersistence)
+		elog(ERROR, "cannot swap the files of relations %u and %u of different persistence",
+			 r1, r2);
+
 	/*
 	 * Actually swap the fields in the two tuples
 	 */
@@ -1248,6 +1954,16 @@ swap_heap_or_index_files(Oid r1, Oid r2)
 	relform1->reltoastrelid = relform2->reltoastrelid;
 	relform2->reltoastrelid = swaptemp;
 
+#if PG_VERSION_NUM >= 120000
+	/* the files of a table are only readable by the access method of them */
+	if (relform1->relkind == RELKIND_RELATION)
+	{
+		swaptemp = relform1->relam;
+		relform1->relam = relform2->relam;
+		relform2->relam = swaptemp;
+	}
+#endif
+
 	/*
 	 * Swap relfrozenxid and relminmxid, as they must be consistent with the data
 	 */
@@ -1305,6 +2021,39 @@ swap_heap_or_index_files(Oid r1, Oid r2)
 
 	CatalogCloseIndexes(indstate);
 
+#if PG_VERSION_NUM >= 120000
+	/*
+	 * Move the dependencies of the tables on their access methods along.
+	 * None is recorded on heap, which is pinned.
+	 */
+	if (relform1->relkind == RELKIND_RELATION &&
+		relform1->relam != relform2->relam)
+	{
+		ObjectAddress	relobject,
+						amobject;
+
+		deleteDependencyRecordsForClass(RelationRelationId, r1,
+										AccessMethodRelationId,
+										DEPENDENCY_NORMAL);
+		deleteDependencyRecordsForClass(RelationRelationId, r2,
+										AccessMethodRelationId,
+										DEPENDENCY_NORMAL);
+
+		relobject.classId = RelationRelationId;
+		relobject.objectSubId = 0;
+		amobject.classId = AccessMethodRelationId;
+		amobject.objectSubId = 0;
+
+		relobject.objectId = r1;
+		amobject.objectId = relform1->relam;
+		recordDependencyOn(&relobject, &amobject, DEPENDENCY_NORMAL);
+
+		relobject.objectId = r2;
+		amobject.objectId = relform2->relam;
+		recordDependencyOn(&relobject, &amobject, DEPENDENCY_NORMAL);
+	}
+#endif
+
 	/*
 	 * If we have toast tables associated with the relations being swapped,
 	 * change their dependency links to re-associate them with their new
@@ -1487,3 +2236,1936 @@ repack_get_table_and_inheritors(PG_FUNCTION_ARGS)
 
 	PG_RETURN_ARRAYTYPE_P(result);
 }
+
+/**
+ * @fn      Datum repack_detoast(PG_FUNCTION_ARGS)
+ * @brief   Return the value uncompressed and inline, so that inserting it
+ *          compresses it again with the compression method of the column.
+ *
+ * detoast(value)
+ *
+ * @param	value	value of any type.
+ * @retval	The same value, detoasted if it is a varlena.
+ */
+Datum
+repack_detoast(PG_FUNCTION_ARGS)
+{
+	Oid			typid = get_fn_expr_argtype(fcinfo->flinfo, 0);
+
+	if (get_typlen(typid) == -1)
+		PG_RETURN_POINTER(PG_DETOAST_DATUM(PG_GETARG_DATUM(0)));
+
+	PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+}
+
+/*
+ * Space-filling curve keys.
+ *
+ * Each column is scaled by repack_curve_coord() to a 32-bit coordinate
+ * between the bounds of its values, so that all the dimensions weigh the
+ * same in the key whatever their ranges. The keys interleave the bits of
+ * the coordinates, most significant first, in a bytea: bytea comparison is
+ * memcmp(), so the keys sort in curve order.
+ */
+#define CURVE_MAX_DIMS		8
+#define CURVE_COORD_MAX		4294967295.0
+
+/* Convert a value of a type supported by the curves to a double */
+static double
+curve_datum_to_double(Datum value, Oid typid)
+{
+	switch (typid)
+	{
+		case INT2OID:
+			return (double) DatumGetInt16(value);
+		case INT4OID:
+			return (double) DatumGetInt32(value);
+		case INT8OID:
+			return (double) DatumGetInt64(value);
+		case FLOAT4OID:
+			return (double) DatumGetFloat4(value);
+		case FLOAT8OID:
+			return DatumGetFloat8(value);
+		case NUMERICOID:
+			return DatumGetFloat8(DirectFunctionCall1(numeric_float8, value));
+		case DATEOID:
+			return (double) DatumGetDateADT(value);
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			return (double) DatumGetTimestamp(value);
+		default:
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+					 errmsg("type %s is not supported by space-filling curves",
+							format_type_be(typid))));
+	}
+	return 0;					/* keep compiler quiet */
+}
+
+/**
+ * @fn      Datum repack_curve_coord(PG_FUNCTION_ARGS)
+ * @brief   Scale a value to a coordinate of a space-filling curve.
+ *
+ * curve_coord(value, lo, hi)
+ *
+ * @param	value	Integer, float, numeric, date or timestamp value.
+ * @param	lo		Lowest value of the column, mapped to 0.
+ * @param	hi		Highest value of the column, mapped to 2^32 - 1.
+ * @retval	The coordinate; values out of the bounds are clamped.
+ */
+Datum
+repack_curve_coord(PG_FUNCTION_ARGS)
+{
+	Oid			typid = get_fn_expr_argtype(fcinfo->flinfo, 0);
+	double		value = curve_datum_to_double(PG_GETARG_DATUM(0), typid);
+	double		lo = curve_datum_to_double(PG_GETARG_DATUM(1), typid);
+	double		hi = curve_datum_to_double(PG_GETARG_DATUM(2), typid);
+	double		frac;
+
+	if (isnan(value))
+		frac = 1.0;				/* NaN sorts after all the other values */
+	else if (!(hi > lo))
+		frac = 0.0;
+	else
+	{
+		frac = (value - lo) / (hi - lo);
+		if (!(frac >= 0.0))
+			frac = 0.0;
+		else if (frac > 1.0)
+			frac = 1.0;
+	}
+
+	PG_RETURN_INT64((int64) (frac * CURVE_COORD_MAX));
+}
+
+/* Get the coordinates of a curve key from an array of bigint */
+static int
+curve_get_coords(ArrayType *array, uint32 *coords)
+{
+	Datum	   *elems;
+	bool	   *nulls;
+	int			n;
+	int			i;
+
+	deconstruct_array(array, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd',
+					  &elems, &nulls, &n);
+	if (n < 1 || n > CURVE_MAX_DIMS)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("space-filling curves need 1 to %d coordinates, got %d",
+						CURVE_MAX_DIMS, n)));
+
+	for (i = 0; i < n; i++)
+	{
+		int64	v = nulls[i] ? (int64) CURVE_COORD_MAX : DatumGetInt64(elems[i]);
+
+		/* NULLs go last, like in an index */
+		coords[i] = (uint32) Max(0, Min(v, (int64) CURVE_COORD_MAX));
+	}
+
+	return n;
+}
+
+/* Interleave the bits of the coordinates into key, one bit at a time */
+static void
+curve_interleave(const uint32 *coords, int n, uint8 *key)
+{
+	int			bit;
+	int			d;
+	int			pos = 0;
+
+	memset(key, 0, n * sizeof(uint32));
+	for (bit = 31; bit >= 0; bit--)
+		for (d = 0; d < n; d++, pos++)
+			if ((coords[d] >> bit) & 1)
+				key[pos >> 3] |= 0x80 >> (pos & 7);
+}
+
+#ifdef USE_PDEP_WITH_RUNTIME_CHECK
+/*
+ * Interleave the bits of 2, 4 or 8 coordinates 64 key bits at a time: each
+ * word of the key holds 64 / n bits of every coordinate, that PDEP deposits
+ * every n bits.
+ */
+__attribute__((target("bmi2")))
+static void
+curve_interleave_pdep(const uint32 *coords, int n, uint8 *key)
+{
+	int			k = 64 / n;		/* bits of each coordinate per word */
+	uint64		spread = n == 2 ? UINT64CONST(0x5555555555555555) :
+						 n == 4 ? UINT64CONST(0x1111111111111111) :
+						 UINT64CONST(0x0101010101010101);
+	int			w;
+	int			d;
+	int			i;
+
+	for (w = 0; w < n / 2; w++)
+	{
+		uint64		word = 0;
+
+		for (d = 0; d < n; d++)
+		{
+			uint64		chunk = ((uint64) coords[d] >> (32 - (w + 1) * k)) &
+								((UINT64CONST(1) << k) - 1);
+
+			word |= _pdep_u64(chunk, spread << (n - 1 - d));
+		}
+		for (i = 0; i < 8; i++)
+			key[w * 8 + i] = (uint8) (word >> (56 - i * 8));
+	}
+}
+
+static bool
+curve_have_pdep(void)
+{
+	static int	have_pdep = -1;
+
+	if (have_pdep < 0)
+	{
+		__builtin_cpu_init();
+		have_pdep = __builtin_cpu_supports("bmi2") ? 1 : 0;
+	}
+	return have_pdep == 1;
+}
+#endif
+
+/* Build the bytea key of the coordinates */
+static bytea *
+curve_make_key(const uint32 *coords, int n)
+{
+	bytea	   *key = (bytea *) palloc(VARHDRSZ + n * sizeof(uint32));
+
+	SET_VARSIZE(key, VARHDRSZ + n * sizeof(uint32));
+#ifdef USE_PDEP_WITH_RUNTIME_CHECK
+	if ((n == 2 || n == 4 || n == 8) && curve_have_pdep())
+	{
+		curve_interleave_pdep(coords, n, (uint8 *) VARDATA(key));
+		return key;
+	}
+#endif
+	curve_interleave(coords, n, (uint8 *) VARDATA(key));
+	return key;
+}
+
+/**
+ * @fn      Datum repack_zorder_key(PG_FUNCTION_ARGS)
+ * @brief   Z-order (Morton) key of the coordinates.
+ *
+ * zorder_key(VARIADIC coords)
+ *
+ * @param	coords	Coordinates computed by curve_coord(), NULLs sort last.
+ * @retval	The key, sorting in Z-order.
+ */
+Datum
+repack_zorder_key(PG_FUNCTION_ARGS)
+{
+	uint32		coords[CURVE_MAX_DIMS];
+	int			n = curve_get_coords(PG_GETARG_ARRAYTYPE_P(0), coords);
+
+	PG_RETURN_BYTEA_P(curve_make_key(coords, n));
+}
+
+/**
+ * @fn      Datum repack_hilbert_key(PG_FUNCTION_ARGS)
+ * @brief   Hilbert curve key of the coordinates.
+ *
+ * hilbert_key(VARIADIC coords)
+ *
+ * The coordinates are transformed in place with Skilling's algorithm
+ * ("Programming the Hilbert curve", 2004), so that the interleaving of
+ * their bits is the index along the Hilbert curve. Unlike the Z-order, two
+ * consecutive keys are always adjacent cells, at the cost of a few more
+ * operations per bit.
+ *
+ * @param	coords	Coordinates computed by curve_coord(), NULLs sort last.
+ * @retval	The key, sorting in Hilbert curve order.
+ */
+Datum
+repack_hilbert_key(PG_FUNCTION_ARGS)
+{
+	uint32		X[CURVE_MAX_DIMS];
+	int			n = curve_get_coords(PG_GETARG_ARRAYTYPE_P(0), X);
+	uint32		P, Q, t;
+	int			i;
+
+	/* inverse undo */
+	for (Q = (uint32) 1 << 31; Q > 1; Q >>= 1)
+	{
+		P = Q - 1;
+		for (i = 0; i < n; i++)
+		{
+			if (X[i] & Q)
+				X[0] ^= P;		/* invert */
+			else
+			{
+				t = (X[0] ^ X[i]) & P;	/* exchange */
+				X[0] ^= t;
+				X[i] ^= t;
+			}
+		}
+	}
+
+	/* Gray encode */
+	for (i = 1; i < n; i++)
+		X[i] ^= X[i - 1];
+	t = 0;
+	for (Q = (uint32) 1 << 31; Q > 1; Q >>= 1)
+		if (X[n - 1] & Q)
+			t ^= Q - 1;
+	for (i = 0; i < n; i++)
+		X[i] ^= t;
+
+	PG_RETURN_BYTEA_P(curve_make_key(X, n));
+}
+
+/*
+ * State of repack_throttle() between its checks: when the last one was done,
+ * and where the WAL was then.
+ */
+static TimestampTz	throttle_time = 0;
+static XLogRecPtr	throttle_lsn = InvalidXLogRecPtr;
+
+/* since when the replay lag is over the limit, and whether we gave up */
+static TimestampTz	throttle_lag_since = 0;
+static bool			throttle_lag_given_up = false;
+
+/* interval between two checks of repack_throttle(), in milliseconds */
+#define THROTTLE_INTERVAL	100
+
+static void
+throttle_sleep(long usecs)
+{
+	while (usecs > 0)
+	{
+		CHECK_FOR_INTERRUPTS();
+		pg_usleep(Min(usecs, THROTTLE_INTERVAL * 1000L));
+		usecs -= THROTTLE_INTERVAL * 1000L;
+	}
+}
+
+/*
+ * State of log_backpressure() between its checks, for the last table.
+ */
+static Oid			backpressure_relid = InvalidOid;
+static TimestampTz	backpressure_time = 0;
+static bool			backpressure_over = false;
+
+/*
+ * Delay the writer of a row by the delay given to repack_trigger while the
+ * backlog of the log is over its limit, so that repack_apply() can catch up.
+ * The log is looked at every THROTTLE_INTERVAL at most; the rows count from
+ * the oldest to the newest id. The size of the log is no measure of the
+ * backlog, as it keeps the rows already applied until the log is dropped.
+ */
+static void
+log_backpressure(Oid relid, Trigger *trigger)
+{
+	int			nkeys = trigger_nkeys(trigger);
+	int64		max_rows;
+	long		delay;
+	TimestampTz	now;
+
+	if (trigger->tgnargs < nkeys + 3)
+		return;
+
+	max_rows = strtoll(trigger->tgargs[nkeys + 1], NULL, 10);
+	delay = strtol(trigger->tgargs[nkeys + 2], NULL, 10);
+
+	now = GetCurrentTimestamp();
+	if (relid != backpressure_relid ||
+		TimestampDifferenceExceeds(backpressure_time, now, THROTTLE_INTERVAL))
+	{
+		HeapTuple	tuple;
+		TupleDesc	desc;
+		bool		isnull;
+		int64		rows;
+
+		execute_with_format(SPI_OK_SELECT,
+			"SELECT coalesce(max(id) - min(id) + 1, 0) FROM repack.log_%u",
+			relid);
+		tuple = SPI_tuptable->vals[0];
+		desc = SPI_tuptable->tupdesc;
+		rows = DatumGetInt64(SPI_getbinval(tuple, desc, 1, &isnull));
+
+		backpressure_over = max_rows > 0 && rows > max_rows;
+		backpressure_relid = relid;
+		backpressure_time = now;
+	}
+
+	if (backpressure_over)
+		throttle_sleep(delay * 1000L);
+}
+
+/*
+ * Largest replay lag of the standbys and logical subscribers, in bytes.
+ */
+static int64
+throttle_replay_lag(void)
+{
+	bool	isnull;
+	Datum	lag;
+	int64	result;
+
+	repack_init();
+#if PG_VERSION_NUM >= 100000
+	execute(SPI_OK_SELECT,
+		"SELECT max(pg_catalog.pg_wal_lsn_diff("
+		"           pg_catalog.pg_current_wal_lsn(), replay_lsn))::int8"
+		"  FROM pg_catalog.pg_stat_replication");
+#else
+	execute(SPI_OK_SELECT,
+		"SELECT max(pg_catalog.pg_xlog_location_diff("
+		"           pg_catalog.pg_current_xlog_location(), replay_location))::int8"
+		"  FROM pg_catalog.pg_stat_replication");
+#endif
+	lag = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+	result = isnull ? 0 : DatumGetInt64(lag);
+	SPI_finish();
+
+	return result;
+}
+
+/**
+ * @fn      Datum repack_throttle(PG_FUNCTION_ARGS)
+ * @brief   Wait while the WAL is written too fast, or the standbys lag too
+ *          far behind.
+ *
+ * repack_throttle(max_wal_rate, max_replay_lag, max_wait)
+ *
+ * Meant to be called for every row written by the copy, and between the
+ * batches of the apply; the checks are only done every THROTTLE_INTERVAL.
+ * The WAL rate is the one of the whole server since the previous check.
+ * A lag over the limit for max_wait seconds in a row, across the calls, is
+ * reported once and no longer waited for until it is back under the limit:
+ * a delayed or paused standby must not hold the copy in its snapshot.
+ *
+ * @param	max_wal_rate	Megabytes of WAL per second, or 0.
+ * @param	max_replay_lag	Megabytes of replay lag, or 0.
+ * @param	max_wait		Seconds of waiting for the replay lag, or 0.
+ * @retval					Always true.
+ */
+Datum
+repack_throttle(PG_FUNCTION_ARGS)
+{
+	int32		max_wal_rate = PG_GETARG_INT32(0);
+	int32		max_replay_lag = PG_GETARG_INT32(1);
+	int32		max_wait = PG_GETARG_INT32(2);
+	TimestampTz	now = GetCurrentTimestamp();
+
+	if (throttle_time != 0 &&
+		!TimestampDifferenceExceeds(throttle_time, now, THROTTLE_INTERVAL))
+		PG_RETURN_BOOL(true);
+
+	if (max_wal_rate > 0 && throttle_time != 0)
+	{
+		long	secs;
+		int		usecs;
+		double	written;
+		double	ahead;
+
+		/* sleep until the WAL written since the last check fits the rate */
+		TimestampDifference(throttle_time, now, &secs, &usecs);
+		written = (double) (GetXLogInsertRecPtr() - throttle_lsn);
+		ahead = written / (max_wal_rate * 1048576.0) - (secs + usecs / 1000000.0);
+		if (ahead > 0)
+			throttle_sleep((long) (ahead * 1000000.0));
+	}
+
+	if (max_replay_lag > 0)
+	{
+		bool	over;
+
+		while ((over = throttle_replay_lag() > max_replay_lag * INT64CONST(1048576)) &&
+			   !throttle_lag_given_up)
+		{
+			if (throttle_lag_since == 0)
+				throttle_lag_since = GetCurrentTimestamp();
+			else if (max_wait > 0 &&
+					 TimestampDifferenceExceeds(throttle_lag_since,
+												GetCurrentTimestamp(),
+												Min(max_wait, INT_MAX / 1000) * 1000))
+			{
+				ereport(WARNING,
+						(errmsg("replay lag over %d MB for %d seconds, no longer waiting for it",
+								max_replay_lag, max_wait)));
+				throttle_lag_given_up = true;
+				break;
+			}
+			throttle_sleep(THROTTLE_INTERVAL * 1000L);
+		}
+		if (!over)
+		{
+			throttle_lag_since = 0;
+			throttle_lag_given_up = false;
+		}
+	}
+
+	throttle_time = GetCurrentTimestamp();
+	throttle_lsn = GetXLogInsertRecPtr();
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Capture of the changes in shared memory. With pg_repack in
+ * shared_preload_libraries and pg_repack.capture_memory set, repack_trigger
+ * appends the changes of the tables being repacked to a ring buffer of
+ * their own instead of inserting them into repack.log_<oid>; the changes
+ * only go to the log table when the ring is full. repack_capture_drain()
+ * moves the changes of the committed transactions to the log table in the
+ * backend of pg_repack, just before repack_apply() needs them, so that the
+ * writes to the log are off the commit path of the application. The ids of
+ * the records are taken from the sequence of the log table when they are
+ * captured, so they are replayed in the same order as the log rows.
+ *
+ * Once a change of a table does not fit in its ring, the ring is no longer
+ * used for the table, and all its changes go to the log table. The log rows
+ * may then follow changes of committed transactions that are still in the
+ * ring, so repack_capture_limit() keeps repack_apply() from reading the log
+ * past the first change left in the ring until it is drained.
+ *
+ * The rings live as long as the server; they are not crash-safe, and a crash
+ * aborts the repack, as it already does.
+ */
+#define REPACK_RING_SLOTS	8
+
+typedef struct RepackRingSlot
+{
+	Oid			dbid;
+	Oid			relid;		/* InvalidOid if the slot is free */
+	Oid			seqid;		/* sequence of the ids of the log table */
+	int			owner;		/* pid of the pg_repack backend */
+	bool		spilled;	/* the changes go to the log table now */
+	uint64		head;		/* where the next record goes */
+	uint64		tail;		/* first record not consumed yet */
+} RepackRingSlot;
+
+typedef struct RepackRing
+{
+	LWLock	   *lock;
+	Size		slot_size;	/* bytes of ring per slot */
+	RepackRingSlot slots[REPACK_RING_SLOTS];
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+} RepackRing;
+
+typedef struct RepackRingRecord
+{
+	uint32		len;		/* MAXALIGNed length of the whole record */
+	bool		consumed;	/* drained, aborted, or padding */
+	TransactionId xid;
+	int64		id;
+	uint32		oldlen;		/* old row, 0 for an INSERT */
+	uint32		newlen;		/* new row, 0 for a DELETE */
+	/* the old and the new row follow, MAXALIGNed */
+} RepackRingRecord;
+
+#define RING_HEADER_SIZE	MAXALIGN(sizeof(RepackRingRecord))
+
+static int	capture_memory = 0;		/* in kB */
+static RepackRing *repack_ring = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static Size
+ring_slot_size(void)
+{
+	return ((Size) capture_memory * 1024 / REPACK_RING_SLOTS) &
+		~((Size) MAXIMUM_ALIGNOF - 1);
+}
+
+static void
+ring_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+	RequestAddinShmemSpace(offsetof(RepackRing, data) +
+						   ring_slot_size() * REPACK_RING_SLOTS);
+#if PG_VERSION_NUM >= 90600
+	RequestNamedLWLockTranche("pg_repack", 1);
+#else
+	RequestAddinLWLocks(1);
+#endif
+}
+
+static void
+ring_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	repack_ring = ShmemInitStruct("pg_repack capture",
+								  offsetof(RepackRing, data) +
+								  ring_slot_size() * REPACK_RING_SLOTS,
+								  &found);
+	if (!found)
+	{
+		memset(repack_ring->slots, 0, sizeof(repack_ring->slots));
+#if PG_VERSION_NUM >= 90600
+		repack_ring->lock = &(GetNamedLWLockTranche("pg_repack"))->lock;
+#else
+		repack_ring->lock = LWLockAssign();
+#endif
+		repack_ring->slot_size = ring_slot_size();
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+void
+_PG_init(void)
+{
+	DefineCustomIntVariable("pg_repack.capture_memory",
+							"Shared memory to capture the changes of the tables being repacked.",
+							"Only used when pg_repack is in shared_preload_libraries.",
+							&capture_memory,
+							0, 0, MAX_KILOBYTES,
+							PGC_POSTMASTER, GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress || capture_memory <= 0)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = ring_shmem_request;
+#else
+	ring_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = ring_shmem_startup;
+}
+
+static RepackRingSlot *
+ring_find(Oid relid)
+{
+	for (int i = 0; i < REPACK_RING_SLOTS; i++)
+	{
+		RepackRingSlot *slot = &repack_ring->slots[i];
+
+		if (slot->relid == relid && slot->dbid == MyDatabaseId)
+			return slot;
+	}
+	return NULL;
+}
+
+static RepackRingRecord *
+ring_at(RepackRingSlot *slot, uint64 pos)
+{
+	Size		size = repack_ring->slot_size;
+
+	return (RepackRingRecord *) (repack_ring->data +
+								 (slot - repack_ring->slots) * size +
+								 pos % size);
+}
+
+/*
+ * Length of the record at pos, or of the space up to the end of the ring
+ * when it is too short for one.
+ */
+static Size
+ring_record_len(RepackRingSlot *slot, uint64 pos)
+{
+	Size		end = repack_ring->slot_size - pos % repack_ring->slot_size;
+
+	return end < RING_HEADER_SIZE ? end : ring_at(slot, pos)->len;
+}
+
+static bool
+ring_consumed(RepackRingSlot *slot, uint64 pos)
+{
+	Size		end = repack_ring->slot_size - pos % repack_ring->slot_size;
+
+	return end < RING_HEADER_SIZE || ring_at(slot, pos)->consumed;
+}
+
+/*
+ * Append the change of repack_trigger() to the ring of the table, if it is
+ * captured and has room for it. Otherwise the ring of the table spills: the
+ * following changes go to the log table as well.
+ */
+static bool
+ring_append(Oid relid, TriggerData *trigdata)
+{
+	TupleDesc	desc = RelationGetDescr(trigdata->tg_relation);
+	HeapTuple	oldtup = NULL;
+	HeapTuple	newtup = NULL;
+	Datum		olddatum = (Datum) 0;
+	Datum		newdatum = (Datum) 0;
+	uint32		oldlen = 0;
+	uint32		newlen = 0;
+	Size		len;
+	Size		size;
+	Size		end;
+	int64		id;
+	uint64		head;
+	RepackRingSlot *slot;
+	RepackRingRecord *rec;
+
+	/*
+	 * The slot of the table only changes while it is locked exclusively, so
+	 * it can be looked up without the lock.
+	 */
+	if (repack_ring == NULL || (slot = ring_find(relid)) == NULL ||
+		slot->spilled)
+		return false;
+
+	if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+		newtup = trigdata->tg_trigtuple;
+	else if (TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+		oldtup = trigdata->tg_trigtuple;
+	else
+	{
+		oldtup = trigdata->tg_trigtuple;
+		newtup = trigdata->tg_newtuple;
+	}
+	if (oldtup)
+	{
+		olddatum = heap_copy_tuple_as_datum(oldtup, desc);
+		oldlen = VARSIZE(DatumGetPointer(olddatum));
+	}
+	if (newtup)
+	{
+		newdatum = heap_copy_tuple_as_datum(newtup, desc);
+		newlen = VARSIZE(DatumGetPointer(newdatum));
+	}
+
+	size = repack_ring->slot_size;
+	len = RING_HEADER_SIZE + MAXALIGN(oldlen) + MAXALIGN(newlen);
+	if (len > size / 4)
+	{
+		ring_spill(relid);
+		return false;
+	}
+
+	id = DatumGetInt64(DirectFunctionCall1(nextval_oid,
+										   ObjectIdGetDatum(slot->seqid)));
+
+	LWLockAcquire(repack_ring->lock, LW_EXCLUSIVE);
+
+	/* a record must not wrap around the end of the ring */
+	head = slot->head;
+	end = size - head % size;
+	if (end >= len)
+		end = 0;
+	if (slot->relid != relid || slot->spilled ||
+		slot->head - slot->tail + end + len > size)
+	{
+		if (slot->relid == relid)
+			slot->spilled = true;
+		LWLockRelease(repack_ring->lock);
+		return false;
+	}
+	if (end >= RING_HEADER_SIZE)
+	{
+		rec = ring_at(slot, head);
+		rec->len = end;
+		rec->consumed = true;
+	}
+	head += end;
+
+	rec = ring_at(slot, head);
+	rec->len = len;
+	rec->consumed = false;
+	rec->xid = GetCurrentTransactionId();
+	rec->id = id;
+	rec->oldlen = oldlen;
+	rec->newlen = newlen;
+	if (oldlen)
+		memcpy((char *) rec + RING_HEADER_SIZE, DatumGetPointer(olddatum), oldlen);
+	if (newlen)
+		memcpy((char *) rec + RING_HEADER_SIZE + MAXALIGN(oldlen),
+			   DatumGetPointer(newdatum), newlen);
+	slot->head = head + len;
+
+	LWLockRelease(repack_ring->lock);
+
+	return true;
+}
+
+/* stop capturing the changes of the table, which go to the log table now */
+static void
+ring_spill(Oid relid)
+{
+	RepackRingSlot *slot;
+
+	LWLockAcquire(repack_ring->lock, LW_EXCLUSIVE);
+	if ((slot = ring_find(relid)) != NULL)
+		slot->spilled = true;
+	LWLockRelease(repack_ring->lock);
+}
+
+static void
+ring_release(Oid relid)
+{
+	RepackRingSlot *slot;
+
+	if (repack_ring == NULL)
+		return;
+
+	LWLockAcquire(repack_ring->lock, LW_EXCLUSIVE);
+	if ((slot = ring_find(relid)) != NULL)
+		slot->relid = InvalidOid;
+	LWLockRelease(repack_ring->lock);
+}
+
+/**
+ * @fn      Datum repack_capture_start(PG_FUNCTION_ARGS)
+ * @brief   Capture the changes of the table in shared memory.
+ *
+ * repack_capture_start(oid)
+ *
+ * @param	oid		Oid of the table, whose log table exists already.
+ * @retval			true if its changes go to shared memory, false if there
+ *					is no shared memory for it.
+ */
+Datum
+repack_capture_start(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Oid			seqid;
+	char	   *seqname;
+	RepackRingSlot *slot;
+
+	/* authority check */
+	must_be_superuser("repack_capture_start");
+
+	if (repack_ring == NULL || repack_ring->slot_size == 0)
+		PG_RETURN_BOOL(false);
+
+	seqname = psprintf("log_%u_id_seq", relid);
+	seqid = get_relname_relid(seqname, get_namespace_oid("repack", false));
+	if (!OidIsValid(seqid))
+		elog(ERROR, "repack_capture_start: sequence repack.%s not found", seqname);
+
+	LWLockAcquire(repack_ring->lock, LW_EXCLUSIVE);
+
+	/* the slot of the table, a free one, or one left by a dead backend */
+	slot = ring_find(relid);
+	for (int i = 0; slot == NULL && i < REPACK_RING_SLOTS; i++)
+	{
+		RepackRingSlot *s = &repack_ring->slots[i];
+
+		if (!OidIsValid(s->relid) || BackendPidGetProc(s->owner) == NULL)
+			slot = s;
+	}
+	if (slot)
+	{
+		slot->dbid = MyDatabaseId;
+		slot->relid = relid;
+		slot->seqid = seqid;
+		slot->owner = MyProcPid;
+		slot->spilled = false;
+		slot->head = slot->tail = 0;
+	}
+
+	LWLockRelease(repack_ring->lock);
+
+	PG_RETURN_BOOL(slot != NULL);
+}
+
+/* a record not consumed yet, seen by repack_capture_drain() */
+typedef struct RingPending
+{
+	uint64		pos;
+	TransactionId xid;
+	int			status;
+} RingPending;
+
+#define RING_IN_PROGRESS	1
+#define RING_COMMITTED		2
+#define RING_ABORTED		3
+
+/* is the committed transaction xid visible to the snapshot? */
+static bool
+xid_visible(TransactionId xid, Snapshot snapshot)
+{
+	if (TransactionIdPrecedes(xid, snapshot->xmin))
+		return true;
+	if (!TransactionIdPrecedes(xid, snapshot->xmax))
+		return false;
+
+	xid = SubTransGetTopmostTransaction(xid);
+	for (uint32 i = 0; i < snapshot->xcnt; i++)
+	{
+		if (TransactionIdEquals(xid, snapshot->xip[i]))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * @fn      Datum repack_capture_drain(PG_FUNCTION_ARGS)
+ * @brief   Move the captured changes of committed transactions to the log.
+ *
+ * repack_capture_drain(oid, snapshot)
+ *
+ * @param	oid			Oid of the table.
+ * @param	snapshot	Skip the changes visible to the snapshot of the
+ *						transaction, which copies the table.
+ * @retval				Number of changes moved to the log table.
+ */
+Datum
+repack_capture_drain(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Snapshot	snapshot = PG_GETARG_BOOL(1) ? GetTransactionSnapshot() : NULL;
+	Snapshot	latest;
+	RepackRingSlot *slot;
+	List	   *pendings = NIL;
+	List	   *records = NIL;
+	ListCell   *cell;
+	TransactionId last_xid = InvalidTransactionId;
+	int			last_status = RING_IN_PROGRESS;
+	Relation	rel;
+	Trigger	   *trigger = NULL;
+	StringInfo	sql;
+	Oid			argtypes[3];
+
+	/* authority check */
+	must_be_superuser("repack_capture_drain");
+
+	if (repack_ring == NULL)
+		PG_RETURN_INT32(0);
+
+	/*
+	 * The status of the transactions is looked up without the lock, which
+	 * every capturing writer takes: the positions and the transactions of
+	 * the records are collected first, and the records are only marked
+	 * consumed afterwards. Nobody else touches the records already appended.
+	 *
+	 * A transaction counts as finished only if it is in a snapshot taken
+	 * before the records are collected, rather than if it happens to be over
+	 * by the time it is looked up: a change that waited for another one to
+	 * commit is then never drained without it.
+	 */
+	latest = GetLatestSnapshot();
+	LWLockAcquire(repack_ring->lock, LW_SHARED);
+	if ((slot = ring_find(relid)) != NULL)
+	{
+		uint64		pos;
+
+		for (pos = slot->tail; pos < slot->head; pos += ring_record_len(slot, pos))
+		{
+			RingPending *pending;
+
+			if (ring_consumed(slot, pos))
+				continue;
+
+			pending = palloc(sizeof(RingPending));
+			pending->pos = pos;
+			pending->xid = ring_at(slot, pos)->xid;
+			pendings = lappend(pendings, pending);
+		}
+	}
+	LWLockRelease(repack_ring->lock);
+
+	foreach(cell, pendings)
+	{
+		RingPending *pending = (RingPending *) lfirst(cell);
+
+		if (!TransactionIdEquals(pending->xid, last_xid))
+		{
+			last_xid = pending->xid;
+			if (!xid_visible(last_xid, latest))
+				last_status = RING_IN_PROGRESS;
+			else if (TransactionIdDidCommit(last_xid))
+				last_status = RING_COMMITTED;
+			else
+				last_status = RING_ABORTED;
+		}
+		pending->status = last_status;
+	}
+
+	LWLockAcquire(repack_ring->lock, LW_EXCLUSIVE);
+	if (slot != NULL && slot->relid == relid && slot->dbid == MyDatabaseId)
+	{
+		foreach(cell, pendings)
+		{
+			RingPending *pending = (RingPending *) lfirst(cell);
+			RepackRingRecord *rec = ring_at(slot, pending->pos);
+
+			if (pending->status == RING_IN_PROGRESS)
+				continue;
+			if (pending->status == RING_COMMITTED &&
+				!(snapshot && xid_visible(rec->xid, snapshot)))
+			{
+				RepackRingRecord *copy = palloc(rec->len);
+
+				memcpy(copy, rec, rec->len);
+				records = lappend(records, copy);
+			}
+			rec->consumed = true;
+		}
+
+		while (slot->tail < slot->head && ring_consumed(slot, slot->tail))
+			slot->tail += ring_record_len(slot, slot->tail);
+	}
+	LWLockRelease(repack_ring->lock);
+
+	if (records == NIL)
+		PG_RETURN_INT32(0);
+
+#if PG_VERSION_NUM >= 120000
+	rel = table_open(relid, AccessShareLock);
+#else
+	rel = heap_open(relid, AccessShareLock);
+#endif
+	for (int i = 0; rel->trigdesc && i < rel->trigdesc->numtriggers; i++)
+	{
+		if (strcmp(rel->trigdesc->triggers[i].tgname, "repack_trigger") == 0)
+			trigger = &rel->trigdesc->triggers[i];
+	}
+	if (trigger == NULL)
+		elog(ERROR, "repack_capture_drain: repack_trigger not found on %u", relid);
+	sql = log_insert_sql(relid, trigger, true);
+	argtypes[0] = argtypes[1] = rel->rd_rel->reltype;
+	argtypes[2] = INT8OID;
+#if PG_VERSION_NUM >= 120000
+	table_close(rel, AccessShareLock);
+#else
+	heap_close(rel, AccessShareLock);
+#endif
+
+	repack_init();
+	foreach(cell, records)
+	{
+		RepackRingRecord *rec = (RepackRingRecord *) lfirst(cell);
+		char	   *data = (char *) rec + RING_HEADER_SIZE;
+		Datum		values[3];
+		bool		nulls[3];
+
+		values[0] = PointerGetDatum(data);
+		nulls[0] = rec->oldlen == 0;
+		values[1] = PointerGetDatum(data + MAXALIGN(rec->oldlen));
+		nulls[1] = rec->newlen == 0;
+		values[2] = Int64GetDatum(rec->id);
+		nulls[2] = false;
+		execute_with_args(SPI_OK_INSERT, sql->data, 3, argtypes, values, nulls);
+	}
+	SPI_finish();
+
+	PG_RETURN_INT32(list_length(records));
+}
+
+/**
+ * @fn      Datum repack_capture_limit(PG_FUNCTION_ARGS)
+ * @brief   First id of the log that repack_apply() must not read yet.
+ *
+ * repack_capture_limit(oid)
+ *
+ * @param	oid		Oid of the table.
+ * @retval			Id of the first change left in the ring of the table if
+ *					it spilled into the log table, or the largest bigint.
+ */
+Datum
+repack_capture_limit(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	int64		limit = PG_INT64_MAX;
+	RepackRingSlot *slot;
+
+	if (repack_ring == NULL)
+		PG_RETURN_INT64(limit);
+
+	LWLockAcquire(repack_ring->lock, LW_SHARED);
+	if ((slot = ring_find(relid)) != NULL && slot->spilled)
+	{
+		uint64		pos;
+
+		for (pos = slot->tail; pos < slot->head; pos += ring_record_len(slot, pos))
+		{
+			if (!ring_consumed(slot, pos))
+				limit = Min(limit, ring_at(slot, pos)->id);
+		}
+	}
+	LWLockRelease(repack_ring->lock);
+
+	PG_RETURN_INT64(limit);
+}
+
+/*
+ * In-place compaction for --compact. The rows of the last pages of a table
+ * are moved into the free space of its first pages with no-op UPDATEs, and
+ * a VACUUM then truncates the empty tail. heap_update() keeps the new version
+ * of a row on its page as long as it fits there, so the rows are updated
+ * again in the same transaction until their dead versions fill the page and
+ * the new one has to go elsewhere; the free space map no longer offers the
+ * pages of the tail, so that elsewhere is one of the first pages.
+ */
+
+/* share of the free space of the first pages that the tail may fill */
+#define COMPACT_FILL		0.8
+
+/*
+ * Free space of a page that inserts may use, as recorded in the free space
+ * map and less the room kept for the fillfactor.
+ */
+static double
+compact_free(Relation rel, BlockNumber blkno)
+{
+	Size	free = GetRecordedFreeSpace(rel, blkno);
+	Size	keep = RelationGetTargetPageFreeSpace(rel, HEAP_DEFAULT_FILLFACTOR);
+
+	return free > keep ? (double) (free - keep) : 0;
+}
+
+/*
+ * Column for the no-op updates of the rows, or NULL if there is none that
+ * can be assigned to itself: dropped, generated and GENERATED ALWAYS AS
+ * IDENTITY columns are left out. A column that no index covers is taken
+ * first, so that the updates don't have to check the unique indexes.
+ */
+static const char *
+compact_column(Relation rel)
+{
+	TupleDesc	desc = RelationGetDescr(rel);
+	Bitmapset  *indexed;
+	const char *column = NULL;
+	bool		column_indexed = true;
+
+#if PG_VERSION_NUM >= 160000
+	indexed = RelationGetIndexAttrBitmap(rel, INDEX_ATTR_BITMAP_HOT_BLOCKING);
+#else
+	indexed = RelationGetIndexAttrBitmap(rel, INDEX_ATTR_BITMAP_ALL);
+#endif
+
+	for (int i = 0; i < desc->natts && column_indexed; i++)
+	{
+#if PG_VERSION_NUM >= 110000
+		Form_pg_attribute attr = TupleDescAttr(desc, i);
+#else
+		Form_pg_attribute attr = desc->attrs[i];
+#endif
+		bool		is_indexed;
+
+		if (attr->attisdropped)
+			continue;
+#if PG_VERSION_NUM >= 100000
+		if (attr->attidentity == ATTRIBUTE_IDENTITY_ALWAYS)
+			continue;
+#endif
+#if PG_VERSION_NUM >= 120000
+		if (attr->attgenerated)
+			continue;
+#endif
+		is_indexed = bms_is_member(attr->attnum - FirstLowInvalidHeapAttributeNumber,
+								   indexed);
+		if (column == NULL || !is_indexed)
+		{
+			column = quote_identifier(NameStr(attr->attname));
+			column_indexed = is_indexed;
+		}
+	}
+
+	bms_free(indexed);
+	return column;
+}
+
+/**
+ * @fn      Datum repack_compact_prepare(PG_FUNCTION_ARGS)
+ * @brief   Find the tail of the table which fits in the free space before it.
+ *
+ * repack_compact_prepare(oid)
+ *
+ * The free space of the pages of the tail is then hidden from the free space
+ * map, so that the rows moved out of it don't come back.
+ *
+ * @param	oid		Oid of the table, just vacuumed.
+ * @retval			First block of the tail, the number of blocks of the
+ *					table if it cannot be compacted, or -1 if it has no
+ *					column that the no-op updates can assign.
+ */
+Datum
+repack_compact_prepare(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Relation	rel;
+	BlockNumber	nblocks;
+	BlockNumber	cutoff;
+	BlockNumber	blkno;
+	double		head_free = 0;
+	double		tail_used = 0;
+
+	/* authority check */
+	must_be_superuser("repack_compact_prepare");
+
+#if PG_VERSION_NUM >= 120000
+	rel = table_open(relid, AccessShareLock);
+#else
+	rel = heap_open(relid, AccessShareLock);
+#endif
+	if (compact_column(rel) == NULL)
+	{
+#if PG_VERSION_NUM >= 120000
+		table_close(rel, AccessShareLock);
+#else
+		heap_close(rel, AccessShareLock);
+#endif
+		PG_RETURN_INT64(-1);
+	}
+
+	nblocks = RelationGetNumberOfBlocks(rel);
+	for (blkno = 0; blkno < nblocks; blkno++)
+		head_free += compact_free(rel, blkno);
+
+	/* grow the tail from the end while its rows fit before it */
+	for (cutoff = nblocks; cutoff > 0; cutoff--)
+	{
+		double	free = compact_free(rel, cutoff - 1);
+		double	used = BLCKSZ - SizeOfPageHeaderData -
+					   GetRecordedFreeSpace(rel, cutoff - 1);
+
+		if (tail_used + used > (head_free - free) * COMPACT_FILL)
+			break;
+		tail_used += used;
+		head_free -= free;
+	}
+
+	if (cutoff < nblocks)
+	{
+		for (blkno = cutoff; blkno < nblocks; blkno++)
+			RecordPageWithFreeSpace(rel, blkno, 0);
+		FreeSpaceMapVacuum(rel);
+	}
+
+#if PG_VERSION_NUM >= 120000
+	table_close(rel, AccessShareLock);
+#else
+	heap_close(rel, AccessShareLock);
+#endif
+
+	PG_RETURN_INT64(cutoff);
+}
+
+/**
+ * @fn      Datum repack_compact_move(PG_FUNCTION_ARGS)
+ * @brief   Move the rows of the last pages of the tail before it.
+ *
+ * repack_compact_move(oid, cutoff, end, pages)
+ *
+ * @param	oid		Oid of the table.
+ * @param	cutoff	First block of the tail, from repack_compact_prepare().
+ * @param	end		Block after the last one holding rows.
+ * @param	pages	Number of blocks to empty.
+ * @retval			First block emptied, which is the next end, or -1 if
+ *					some rows could not be moved before the cutoff.
+ */
+Datum
+repack_compact_move(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	int64		cutoff = PG_GETARG_INT64(1);
+	int64		end = PG_GETARG_INT64(2);
+	int32		pages = PG_GETARG_INT32(3);
+	int64		start = Max(cutoff, end - pages);
+	Relation	rel;
+	const char *column;
+	BlockNumber	nblocks;
+	BlockNumber	blkno;
+	List	   *tids = NIL;
+	StringInfoData	sql;
+	Oid			argtypes[1];
+	bool		nulls[1] = { false };
+
+	/* authority check */
+	must_be_superuser("repack_compact_move");
+
+#if PG_VERSION_NUM >= 120000
+	rel = table_open(relid, AccessShareLock);
+#else
+	rel = heap_open(relid, AccessShareLock);
+#endif
+
+	column = compact_column(rel);
+	if (column == NULL)
+		elog(ERROR, "repack_compact_move: no column to update in \"%s\"",
+			 RelationGetRelationName(rel));
+
+	/* the rows of the pages to empty */
+	nblocks = RelationGetNumberOfBlocks(rel);
+	for (blkno = start; blkno < end && blkno < nblocks; blkno++)
+	{
+		Buffer			buf;
+		Page			page;
+		OffsetNumber	off;
+		OffsetNumber	maxoff;
+
+		RecordPageWithFreeSpace(rel, blkno, 0);
+
+		buf = ReadBuffer(rel, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+#if PG_VERSION_NUM >= 90600 && PG_VERSION_NUM < 100000
+		page = BufferGetPage(buf, NULL, NULL, BGP_NO_SNAPSHOT_TEST);
+#else
+		page = BufferGetPage(buf);
+#endif
+		maxoff = PageGetMaxOffsetNumber(page);
+		for (off = FirstOffsetNumber; off <= maxoff; off++)
+		{
+			if (ItemIdIsNormal(PageGetItemId(page, off)))
+			{
+				ItemPointer	tid = palloc(sizeof(ItemPointerData));
+
+				ItemPointerSet(tid, blkno, off);
+				tids = lappend(tids, tid);
+			}
+		}
+		UnlockReleaseBuffer(buf);
+	}
+
+	/* don't insert into the tail because it was the last page used */
+	RelationSetTargetBlock(rel, InvalidBlockNumber);
+
+#if PG_VERSION_NUM >= 120000
+	table_close(rel, AccessShareLock);
+#else
+	heap_close(rel, AccessShareLock);
+#endif
+
+	repack_init();
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql,
+		"UPDATE ONLY %s.%s SET %s = %s WHERE ctid = ANY($1) RETURNING ctid",
+		get_quoted_nspname(relid), get_quoted_relname(relid), column, column);
+	argtypes[0] = get_array_type(TIDOID);
+
+	/*
+	 * Each round leaves a dead version on the page of the rows still in the
+	 * tail, so a page is full after MaxHeapTuplesPerPage rounds at most.
+	 */
+	for (int round = 0; tids != NIL && round < MaxHeapTuplesPerPage; round++)
+	{
+		Datum	   *elems = palloc(sizeof(Datum) * list_length(tids));
+		Datum		values[1];
+		ListCell   *cell;
+		int			n = 0;
+
+		foreach(cell, tids)
+			elems[n++] = PointerGetDatum(lfirst(cell));
+		values[0] = PointerGetDatum(construct_array(elems, n, TIDOID,
+									sizeof(ItemPointerData), false, 's'));
+		execute_with_args(SPI_OK_UPDATE_RETURNING, sql.data, 1, argtypes,
+						  values, nulls);
+
+		tids = NIL;
+		for (uint64 i = 0; i < SPI_processed; i++)
+		{
+			bool		isnull;
+			ItemPointer	tid;
+
+			tid = (ItemPointer) DatumGetPointer(SPI_getbinval(
+						SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isnull));
+			if (ItemPointerGetBlockNumber(tid) >= cutoff)
+			{
+				ItemPointer	copy = palloc(sizeof(ItemPointerData));
+
+				ItemPointerCopy(tid, copy);
+				tids = lappend(tids, copy);
+			}
+		}
+	}
+
+	SPI_finish();
+
+	PG_RETURN_INT64(tids == NIL ? start : -1);
+}
+
+/*
+ * Server-side jobs of repack.start(). A background worker repacks the table
+ * through the same phases as the client, each in its own transaction: setup
+ * of the log and trigger, copy, index builds, apply of the log, swap and
+ * drop. The AccessShare lock that the client holds from a second connection
+ * between the phases is a session lock of the worker, so nothing depends on
+ * a client staying connected. The progress is kept in repack.jobs, and an
+ * error rolls the job back and drops the temporary objects like
+ * repack_cleanup() does.
+ */
+
+/* batches of the apply, as the defaults of --apply-count and --switch-threshold */
+#define JOB_APPLY_COUNT			1000
+#define JOB_SWITCH_THRESHOLD	100
+
+/* arguments of the worker, in bgw_extra */
+typedef struct RepackJobArgs
+{
+	Oid				dbid;
+	Oid				userid;
+	int32			id;
+	TransactionId	xid;		/* of the transaction of repack.start() */
+} RepackJobArgs;
+
+typedef struct RepackJob
+{
+	int32		id;
+	Oid			relid;
+	bool		created;		/* the temporary objects exist */
+	LockRelId	lockid;
+
+	/* options */
+	char	   *order_by;		/* NULL: cluster key, "": no order */
+	char	   *tablespace;
+	bool		analyze;
+	int			wait_timeout;	/* in seconds */
+
+	/* from repack.tables */
+	char	   *relname;
+	char	   *create_pktype;
+	char	   *create_log;
+	char	   *create_trigger;
+	char	   *enable_trigger;
+	char	   *tablespace_orig;
+	char	   *copy_data;
+	char	   *alter_col_storage;
+	char	   *drop_columns;
+	char	   *delete_log;
+	char	   *ckey;
+	char	   *sql_peek;
+	char	   *sql_insert;
+	char	   *sql_delete;
+	char	   *sql_update;
+	char	   *sql_pop;
+
+	char	   *vxids;			/* transactions to wait for before the swap */
+} RepackJob;
+
+/* the transactions running at the time of the copy, as SQL_XID_SNAPSHOT */
+#define JOB_XID_SNAPSHOT \
+	"SELECT coalesce(array_agg(l.virtualtransaction), '{}') " \
+	"  FROM pg_locks AS l " \
+	"  LEFT JOIN pg_stat_activity AS a " \
+	"    ON l.pid = a.pid " \
+	"  LEFT JOIN pg_database AS d " \
+	"    ON a.datid = d.oid " \
+	"  WHERE l.locktype = 'virtualxid' " \
+	"  AND l.pid <> pg_backend_pid() " \
+	"  AND (l.virtualxid, l.virtualtransaction) <> ('1/1', '-1/0') " \
+	"  AND (a.application_name IS NULL OR a.application_name <> 'pg_repack')" \
+	"  AND a.query !~* E'^\\\\s*vacuum\\\\s+' " \
+	"  AND a.query !~ E'^autovacuum: ' " \
+	"  AND ((d.datname IS NULL OR d.datname = current_database()) OR l.database = 0)"
+
+/*
+ * Options of repack.start(), a subset of those of the client.
+ */
+static void
+job_options(ArrayType *options, RepackJob *job)
+{
+	Datum	   *elems;
+	bool	   *nulls;
+	int			n;
+
+	job->order_by = NULL;
+	job->tablespace = NULL;
+	job->analyze = true;
+	job->wait_timeout = 60;
+
+	deconstruct_array(options, TEXTOID, -1, false, 'i', &elems, &nulls, &n);
+	for (int i = 0; i < n; i++)
+	{
+		char	   *opt;
+
+		if (nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("options of repack.start() must not be null")));
+		opt = TextDatumGetCString(elems[i]);
+
+		if (strcmp(opt, "--no-order") == 0)
+			job->order_by = "";
+		else if (strncmp(opt, "--order-by=", 11) == 0)
+			job->order_by = opt + 11;
+		else if (strncmp(opt, "--tablespace=", 13) == 0)
+			job->tablespace = opt + 13;
+		else if (strcmp(opt, "--no-analyze") == 0)
+			job->analyze = false;
+		else if (strncmp(opt, "--wait-timeout=", 15) == 0)
+			job->wait_timeout = atoi(opt + 15);
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("unrecognized option \"%s\"", opt),
+					 errhint("repack.start() accepts --no-order, --order-by, --tablespace, --no-analyze and --wait-timeout.")));
+	}
+}
+
+/**
+ * @fn      Datum repack_start(PG_FUNCTION_ARGS)
+ * @brief   Start a background worker repacking a table.
+ *
+ * repack_start(relation, VARIADIC options)
+ *
+ * The worker waits for the calling transaction to commit its job.
+ *
+ * @param	relation	Oid of the table.
+ * @param	options		Command line options, as '--no-order'.
+ * @retval				Id of the job in repack.jobs.
+ */
+Datum
+repack_start(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	ArrayType  *options = PG_GETARG_ARRAYTYPE_P(1);
+	RepackJob	job;
+	RepackJobArgs args;
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+	pid_t		pid;
+	bool		isnull;
+	Oid			argtypes[2] = { OIDOID, TEXTARRAYOID };
+	Datum		values[2];
+	bool		nulls[2] = { false, false };
+
+	/* authority check */
+	must_be_superuser("repack_start");
+
+	job_options(options, &job);
+
+	repack_init();
+	execute_with_format(SPI_OK_SELECT,
+		"SELECT pkid FROM repack.tables WHERE relid = %u", relid);
+	if (SPI_processed == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not a table that pg_repack can repack",
+						get_rel_name(relid))));
+	SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+	if (isnull)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TABLE_DEFINITION),
+				 errmsg("relation \"%s\" must have a primary key or not-null unique keys",
+						get_rel_name(relid))));
+
+	values[0] = ObjectIdGetDatum(relid);
+	values[1] = PointerGetDatum(options);
+	execute_with_args(SPI_OK_INSERT_RETURNING,
+		"INSERT INTO repack.jobs (relid, options, phase)"
+		" VALUES ($1, $2, 'starting') RETURNING id",
+		2, argtypes, values, nulls);
+	args.id = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
+										  SPI_tuptable->tupdesc, 1, &isnull));
+	SPI_finish();
+
+	args.dbid = MyDatabaseId;
+	args.userid = GetUserId();
+	args.xid = GetCurrentTransactionId();
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+					   BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_repack");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "repack_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_repack job %d", args.id);
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_repack");
+#endif
+	memcpy(worker.bgw_extra, &args, sizeof(args));
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not register a background worker for pg_repack"),
+				 errhint("You may need to increase max_worker_processes.")));
+	if (WaitForBackgroundWorkerStartup(handle, &pid) != BGWH_STARTED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not start a background worker for pg_repack")));
+
+	PG_RETURN_INT32(args.id);
+}
+
+/* start a transaction of the job, connected to SPI */
+static void
+job_begin(int isolation)
+{
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	XactIsoLevel = isolation;
+	repack_init();
+	PushActiveSnapshot(GetTransactionSnapshot());
+}
+
+static void
+job_commit(void)
+{
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+}
+
+/* record the phase in its own transaction, so that it is seen at once */
+static void
+job_phase(RepackJob *job, const char *phase)
+{
+	job_begin(XACT_READ_COMMITTED);
+	execute_with_format(SPI_OK_UPDATE,
+		"UPDATE repack.jobs SET phase = %s, pid = %d, phase_started = now()"
+		" WHERE id = %d", quote_literal_cstr(phase), MyProcPid, job->id);
+	job_commit();
+	pgstat_report_activity(STATE_RUNNING, phase);
+}
+
+/* a column of the first row of the last query, copied out of SPI */
+static char *
+job_value(const char *column)
+{
+	int		fnumber = SPI_fnumber(SPI_tuptable->tupdesc, column);
+	char   *value;
+
+	value = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, fnumber);
+	return value ? MemoryContextStrdup(TopMemoryContext, value) : NULL;
+}
+
+/*
+ * Take an AccessExclusive lock on the relation, cancelling the queries that
+ * hold conflicting locks after wait_timeout and terminating them after twice
+ * that, as lock_exclusive() of the client does. Like the client, the worker
+ * waits in the lock queue with a short lock_timeout rather than polling, so
+ * that a stream of weaker locks cannot keep it out, and retries in a new
+ * subtransaction when the timeout expires.
+ */
+static void
+job_lock_exclusive(RepackJob *job, Oid relid)
+{
+	TimestampTz	start = GetCurrentTimestamp();
+	const char *relname = psprintf("%s.%s", get_quoted_nspname(relid),
+								   get_quoted_relname(relid));
+
+	for (int i = 1; ; i++)
+	{
+		TimestampTz		now = GetCurrentTimestamp();
+		MemoryContext	oldcxt = CurrentMemoryContext;
+		ResourceOwner	oldowner = CurrentResourceOwner;
+		volatile bool	locked = false;
+
+		if (TimestampDifferenceExceeds(start, now, job->wait_timeout * 1000))
+			execute_with_format(SPI_OK_SELECT,
+				"SELECT pg_catalog.%s(pid) FROM pg_catalog.pg_locks"
+				" WHERE locktype = 'relation' AND relation = %u"
+				" AND pid <> pg_catalog.pg_backend_pid()",
+				TimestampDifferenceExceeds(start, now, job->wait_timeout * 2000) ?
+				"pg_terminate_backend" : "pg_cancel_backend", relid);
+
+		BeginInternalSubTransaction(NULL);
+		MemoryContextSwitchTo(oldcxt);
+		PG_TRY();
+		{
+			execute_with_format(SPI_OK_UTILITY, "SET LOCAL lock_timeout = %d",
+								Min(1000, i * 100));
+			execute_with_format(SPI_OK_UTILITY,
+				"LOCK TABLE %s IN ACCESS EXCLUSIVE MODE", relname);
+			ReleaseCurrentSubTransaction();
+			locked = true;
+		}
+		PG_CATCH();
+		{
+			ErrorData  *edata;
+
+			MemoryContextSwitchTo(oldcxt);
+			edata = CopyErrorData();
+			FlushErrorState();
+			RollbackAndReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcxt);
+			CurrentResourceOwner = oldowner;
+
+			/* retry if the lock conflicted */
+			if (edata->sqlerrcode != ERRCODE_LOCK_NOT_AVAILABLE)
+				ReThrowError(edata);
+			FreeErrorData(edata);
+		}
+		PG_END_TRY();
+		MemoryContextSwitchTo(oldcxt);
+		CurrentResourceOwner = oldowner;
+
+		if (locked)
+			break;
+	}
+}
+
+/* repack_apply() of up to count rows of the log, 0 for all */
+static int
+job_apply(RepackJob *job, int count)
+{
+	bool	isnull;
+
+	execute_with_format(SPI_OK_SELECT,
+		"SELECT repack.repack_apply(%s, %s, %s, %s, %s, %d, NULL, 0)",
+		quote_literal_cstr(job->sql_peek), quote_literal_cstr(job->sql_insert),
+		quote_literal_cstr(job->sql_delete), quote_literal_cstr(job->sql_update),
+		quote_literal_cstr(job->sql_pop), count);
+	return DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
+									   SPI_tuptable->tupdesc, 1, &isnull));
+}
+
+static void
+job_run(RepackJob *job)
+{
+	bool		isnull;
+	const char *order_by;
+	List	   *indexdefs = NIL;
+	ListCell   *cell;
+
+	/*
+	 * 1. Setup the log table and the trigger.
+	 */
+	job_phase(job, "setup");
+	job_begin(XACT_READ_COMMITTED);
+	execute_with_format(SPI_OK_SELECT,
+		"SELECT pg_try_advisory_lock(16185446, CAST(-2147483648 + %u::bigint AS integer))",
+		job->relid);
+	if (!DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+									SPI_tuptable->tupdesc, 1, &isnull)))
+		ereport(ERROR,
+				(errcode(ERRCODE_LOCK_NOT_AVAILABLE),
+				 errmsg("Another pg_repack command may be running on the table. Please try again later.")));
+	job_lock_exclusive(job, job->relid);
+
+	execute_with_format(SPI_OK_SELECT,
+		"SELECT repack.conflicted_triggers(%u)", job->relid);
+	if (SPI_processed > 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_DUPLICATE_OBJECT),
+				 errmsg("the table \"%s\" already has a trigger called \"%s\"",
+						get_rel_name(job->relid), "repack_trigger")));
+
+	execute_with_format(SPI_OK_SELECT,
+		"SELECT * FROM repack.tables WHERE relid = %u", job->relid);
+	if (SPI_processed == 0)
+		elog(ERROR, "pg_repack: table %u cannot be repacked", job->relid);
+	job->relname = job_value("relname");
+	job->create_pktype = job_value("create_pktype");
+	job->create_log = job_value("create_log");
+	job->create_trigger = job_value("create_trigger");
+	job->enable_trigger = job_value("enable_trigger");
+	job->tablespace_orig = job_value("tablespace_orig");
+	job->copy_data = job_value("copy_data");
+	job->alter_col_storage = job_value("alter_col_storage");
+	job->drop_columns = job_value("drop_columns");
+	job->delete_log = job_value("delete_log");
+	job->ckey = job_value("ckey");
+	job->sql_peek = job_value("sql_peek");
+	job->sql_insert = job_value("sql_insert");
+	job->sql_delete = job_value("sql_delete");
+	job->sql_update = job_value("sql_update");
+	job->sql_pop = job_value("sql_pop");
+
+	execute(SPI_OK_SELECT, job->create_pktype);
+	execute(SPI_OK_SELECT, job->create_log);
+	execute(SPI_OK_UTILITY, job->create_trigger);
+	execute(SPI_OK_UTILITY, job->enable_trigger);
+	execute_with_format(SPI_OK_SELECT,
+		"SELECT repack.disable_autovacuum('repack.log_%u')", job->relid);
+
+	/* keep DDL away from the table until the end, across the transactions */
+	job->lockid.relId = job->relid;
+	job->lockid.dbId = MyDatabaseId;
+	LockRelationIdForSession(&job->lockid, AccessShareLock);
+	job_commit();
+	job->created = true;
+
+	/*
+	 * 2. Copy the rows into the new table.
+	 */
+	job_phase(job, "copy");
+	job_begin(XACT_SERIALIZABLE);
+	execute(SPI_OK_SELECT,
+		"SELECT set_config('work_mem', current_setting('maintenance_work_mem'), true)");
+	execute(SPI_OK_SELECT, JOB_XID_SNAPSHOT);
+	job->vxids = job_value("coalesce");
+	execute(SPI_OK_DELETE, job->delete_log);
+	execute_with_format(SPI_OK_SELECT, "SELECT repack.create_table(%u, %s)",
+		job->relid, quote_literal_cstr(job->tablespace ? job->tablespace :
+													  job->tablespace_orig));
+	if (job->alter_col_storage)
+		execute(SPI_OK_UTILITY, job->alter_col_storage);
+
+	order_by = job->order_by ? job->order_by : job->ckey;
+	if (order_by && order_by[0])
+		execute_with_format(SPI_OK_INSERT, "%s ORDER BY %s",
+							job->copy_data, order_by);
+	else
+		execute(SPI_OK_INSERT, job->copy_data);
+	if (job->drop_columns)
+		execute(SPI_OK_UTILITY, job->drop_columns);
+	execute_with_format(SPI_OK_SELECT,
+		"SELECT repack.disable_autovacuum('repack.table_%u')", job->relid);
+	job_commit();
+
+	/*
+	 * 3. Build the indexes on the new table.
+	 */
+	job_phase(job, "index");
+	job_begin(XACT_READ_COMMITTED);
+	execute_with_format(SPI_OK_SELECT,
+		"SELECT repack.repack_indexdef(indexrelid, indrelid, NULL, false)"
+		" FROM pg_index WHERE indrelid = %u AND indisvalid", job->relid);
+	for (uint64 i = 0; i < SPI_processed; i++)
+		indexdefs = lappend(indexdefs, SPI_getvalue(SPI_tuptable->vals[i],
+													SPI_tuptable->tupdesc, 1));
+	foreach(cell, indexdefs)
+		execute(SPI_OK_UTILITY, (char *) lfirst(cell));
+	job_commit();
+
+	/*
+	 * 4. Apply the log until it is nearly empty and the transactions older
+	 * than the copy are finished.
+	 */
+	job_phase(job, "apply");
+	for (;;)
+	{
+		int		num;
+		bool	alive = false;
+
+		job_begin(XACT_READ_COMMITTED);
+		num = job_apply(job, JOB_APPLY_COUNT);
+		if (num <= JOB_SWITCH_THRESHOLD)
+		{
+			execute_with_format(SPI_OK_SELECT,
+				"SELECT pid FROM pg_locks WHERE locktype = 'virtualxid'"
+				" AND pid <> pg_backend_pid() AND virtualtransaction = ANY(%s)",
+				quote_literal_cstr(job->vxids));
+			alive = SPI_processed > 0;
+		}
+		job_commit();
+
+		if (num > JOB_SWITCH_THRESHOLD)
+			continue;
+		if (!alive)
+			break;
+		throttle_sleep(1000000L);
+	}
+
+	/*
+	 * 5. Swap the files of the tables.
+	 */
+	job_phase(job, "swap");
+	job_begin(XACT_READ_COMMITTED);
+	job_lock_exclusive(job, job->relid);
+	job_lock_exclusive(job, get_relname_relid(psprintf("table_%u", job->relid),
+											  get_namespace_oid("repack", false)));
+	job_apply(job, 0);
+	execute_with_format(SPI_OK_SELECT, "SELECT repack.repack_swap(%u)",
+						job->relid);
+	job_commit();
+
+	/*
+	 * 6. Drop the temporary objects.
+	 */
+	job_phase(job, "drop");
+	job_begin(XACT_READ_COMMITTED);
+	job_lock_exclusive(job, job->relid);
+	execute_with_format(SPI_OK_SELECT, "SELECT repack.repack_drop(%u, 4)",
+						job->relid);
+	job_commit();
+	job->created = false;
+	UnlockRelationIdForSession(&job->lockid, AccessShareLock);
+
+	/*
+	 * 7. Analyze.
+	 */
+	if (job->analyze)
+	{
+		job_phase(job, "analyze");
+		job_begin(XACT_READ_COMMITTED);
+		execute_with_format(SPI_OK_UTILITY, "ANALYZE %s", job->relname);
+		job_commit();
+	}
+
+	job_phase(job, "done");
+}
+
+/*
+ * Entry point of the background workers of repack.start().
+ */
+void
+repack_worker_main(Datum main_arg)
+{
+	RepackJobArgs	args;
+	RepackJob		job;
+	bool			isnull;
+
+	memcpy(&args, MyBgworkerEntry->bgw_extra, sizeof(args));
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnectionByOid(args.dbid, args.userid, 0);
+#else
+	BackgroundWorkerInitializeConnectionByOid(args.dbid, args.userid);
+#endif
+
+	memset(&job, 0, sizeof(job));
+	job.id = args.id;
+
+	/* the job is there once repack.start() has committed */
+	job_begin(XACT_READ_COMMITTED);
+	XactLockTableWait(args.xid, NULL, NULL, XLTW_None);
+	PopActiveSnapshot();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	execute_with_format(SPI_OK_SELECT,
+		"SELECT relid, options FROM repack.jobs WHERE id = %d", job.id);
+	if (SPI_processed == 0)
+	{
+		job_commit();
+		proc_exit(0);
+	}
+	job.relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0],
+											   SPI_tuptable->tupdesc, 1, &isnull));
+	{
+		MemoryContext	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+		Datum			options = SPI_getbinval(SPI_tuptable->vals[0],
+												SPI_tuptable->tupdesc, 2, &isnull);
+
+		job_options(DatumGetArrayTypePCopy(options), &job);
+		MemoryContextSwitchTo(oldcxt);
+	}
+	job_commit();
+
+	PG_TRY();
+	{
+		job_run(&job);
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		HOLD_INTERRUPTS();
+		MemoryContextSwitchTo(TopMemoryContext);
+		edata = CopyErrorData();
+		EmitErrorReport();
+		FlushErrorState();
+		AbortOutOfAnyTransaction();
+		RESUME_INTERRUPTS();
+
+		job_begin(XACT_READ_COMMITTED);
+		execute_with_format(SPI_OK_UPDATE,
+			"UPDATE repack.jobs SET phase = 'failed', error = %s,"
+			" phase_started = now() WHERE id = %d",
+			quote_literal_cstr(edata->message ? edata->message : ""), job.id);
+		job_commit();
+
+		/* as repack_cleanup() */
+		if (job.created)
+		{
+			job_begin(XACT_READ_COMMITTED);
+			job_lock_exclusive(&job, job.relid);
+			execute_with_format(SPI_OK_SELECT,
+				"SELECT repack.repack_drop(%u, 4)", job.relid);
+			job_commit();
+		}
+		proc_exit(1);
+	}
+	PG_END_TRY();
+
+	proc_exit(0);
+}
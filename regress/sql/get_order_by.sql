@@ -33,3 +33,40 @@ CREATE TABLE issue321 (col1 int NOT NULL, col2 text NOT NULL);
 CREATE UNIQUE INDEX issue321_idx ON issue321 (col1);
 SELECT repack.get_order_by('issue321_idx'::regclass::oid, 1);
 SELECT repack.get_order_by(1, 1);
+
+--
+-- columns whose correlation changes when repacking in a given order
+--
+SELECT repack.get_order_columns('issue3_5'::regclass, repack.get_order_by('issue3_5_idx'::regclass::oid, 'issue3_5'::regclass::oid));
+SELECT repack.get_order_columns('issue3_2'::regclass, 'COL2 DESC, "col1"');
+SELECT repack.get_order_columns('issue3_2'::regclass, 'length(col2)');
+\! pg_repack --dbname=contrib_regression --table=issue3_5 --keep-statistics
+
+--
+-- space-filling curves
+--
+SELECT repack.curve_coord(5, 0, 10), repack.curve_coord(20, 0, 10),
+       repack.curve_coord('2020-01-01'::date, '2019-01-01', '2021-01-01');
+SELECT repack.zorder_key(1, 2), repack.hilbert_key(1, 2);
+CREATE TABLE curve_tbl (id serial PRIMARY KEY, x integer, y integer);
+INSERT INTO curve_tbl (x, y) SELECT x, y FROM generate_series(0, 3) x, generate_series(0, 3) y;
+\! pg_repack --dbname=contrib_regression --table=curve_tbl --order-by-curve=x,y
+SELECT string_agg(x || ',' || y, ' ') FROM curve_tbl;
+\! pg_repack --dbname=contrib_regression --table=curve_tbl --order-by-curve=x,y --curve=hilbert
+SELECT string_agg(x || ',' || y, ' ') FROM curve_tbl;
+\! pg_repack --dbname=contrib_regression --table=curve_tbl --order-by-curve=x,y --curve=peano
+\! pg_repack --dbname=contrib_regression --table=curve_tbl --order-by-curve=x,y --order-by=id
+
+--
+-- clustering key advisor
+--
+CREATE TABLE advise_tbl (id integer PRIMARY KEY, ts timestamp NOT NULL);
+CREATE INDEX advise_tbl_ts_idx ON advise_tbl USING brin (ts);
+INSERT INTO advise_tbl SELECT i, '2020-01-01'::timestamp - i * interval '1 day' FROM generate_series(1, 9) i;
+SELECT * FROM repack.advise_order_by('advise_tbl'::regclass);
+\! pg_repack --dbname=contrib_regression --table=advise_tbl --auto-order
+SELECT string_agg(id::text, ',') FROM advise_tbl;
+-- the key the table is ordered by keeps its place
+\! pg_repack --dbname=contrib_regression --table=advise_tbl --auto-order
+SELECT string_agg(id::text, ',') FROM advise_tbl;
+\! pg_repack --dbname=contrib_regression --table=advise_tbl --auto-order --order-by=id
@@ -178,6 +178,133 @@ CREATE TABLE child_b_2(val integer primary key) INHERITS(parent_b);
 -- Switch threshold
 --
 \! pg_repack --dbname=contrib_regression --table=tbl_cluster --switch-threshold 200
+--
+-- Estimate
+--
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --estimate --estimate-interval=0
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --estimate --only-indexes
+--
+-- Storage parameters
+--
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --fillfactor=5
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --fillfactor=often
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --toast-tuple-target=10
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --compression=zstd
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --index-fillfactor=101
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --deduplicate-items=maybe
+CREATE TABLE tbl_storage (id integer PRIMARY KEY, val text);
+INSERT INTO tbl_storage SELECT i, repeat('x', i) FROM generate_series(1, 100) i;
+\! pg_repack --dbname=contrib_regression --table=tbl_storage --fillfactor=70 --toast-tuple-target=256
+SELECT reloptions FROM pg_class WHERE relname = 'tbl_storage';
+SELECT repack.advise_fillfactor('tbl_storage'::regclass);
+SELECT count(*), sum(length(val)) FROM tbl_storage;
+--
+-- Purge
+--
+CREATE TABLE tbl_purge (id integer PRIMARY KEY, val text);
+INSERT INTO tbl_purge SELECT i, 'val' || i FROM generate_series(1, 10) i;
+\! pg_repack --dbname=contrib_regression --table=tbl_purge --purge-where='id > 5 OR val IS NULL'
+SELECT count(*), min(id), max(id) FROM tbl_purge;
+CREATE TABLE tbl_purge_ref (id integer PRIMARY KEY REFERENCES tbl_purge);
+\! pg_repack --dbname=contrib_regression --table=tbl_purge --purge-where='id > 2'
+SELECT count(*), min(id), max(id) FROM tbl_purge;
+--
+-- Alter column
+--
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --alter-column=id
+CREATE TABLE tbl_alter (id integer PRIMARY KEY, val varchar(10), n integer DEFAULT 0);
+CREATE INDEX tbl_alter_val_idx ON tbl_alter (val);
+INSERT INTO tbl_alter SELECT i, 'val' || i FROM generate_series(1, 100) i;
+\! pg_repack --dbname=contrib_regression --table=tbl_alter --alter-column=id:bigint --alter-column=val:text
+SELECT attname, format_type(atttypid, atttypmod) FROM pg_attribute
+WHERE attrelid = 'tbl_alter'::regclass AND attnum > 0 ORDER BY attnum;
+SELECT count(*), sum(id), max(val) FROM tbl_alter;
+SET enable_seqscan = off;
+SELECT * FROM tbl_alter WHERE val = 'val42';
+RESET enable_seqscan;
+--
+-- Add index
+--
+CREATE TABLE tbl_addidx (id integer PRIMARY KEY, val integer);
+INSERT INTO tbl_addidx SELECT i, i % 10 FROM generate_series(1, 100) i;
+\! pg_repack --dbname=contrib_regression --table=tbl_addidx --add-index='CREATE INDEX tbl_addidx_val_idx ON tbl_addidx (val) WHERE val > 5'
+\! pg_repack --dbname=contrib_regression --table=tbl_addidx --add-index='CREATE INDEX tbl_only_pkey_idx ON tbl_only_pkey (col1)'
+\! pg_repack --dbname=contrib_regression --table=tbl_addidx --add-index='CREATE INDEX nosuch_idx ON nosuch (val)'
+SELECT indexrelid::regclass, indpred IS NOT NULL AS partial FROM pg_index
+WHERE indrelid = 'tbl_addidx'::regclass ORDER BY 1;
+SET enable_seqscan = off;
+SELECT count(*) FROM tbl_addidx WHERE val > 7;
+RESET enable_seqscan;
+--
+-- Access method
+--
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --access-method=nosuch
+--
+-- Unlogged table
+--
+CREATE UNLOGGED TABLE tbl_unlogged (id integer PRIMARY KEY, val text);
+INSERT INTO tbl_unlogged SELECT i, 'val' || i FROM generate_series(1, 100) i;
+\! pg_repack --dbname=contrib_regression --table=tbl_unlogged
+SELECT relname, relpersistence FROM pg_class
+WHERE relname IN ('tbl_unlogged', 'tbl_unlogged_pkey') ORDER BY relname;
+SELECT count(*) FROM tbl_unlogged;
+--
+-- Throttled repack
+--
+\! pg_repack --dbname=contrib_regression --table=tbl_unlogged --max-wal-rate=1000 --max-replay-lag=1000
+SELECT count(*) FROM tbl_unlogged;
+\! pg_repack --dbname=contrib_regression --table=tbl_unlogged --max-wal-rate=-1
+\! pg_repack --dbname=contrib_regression --table=tbl_unlogged --max-replay-lag=1000 --max-throttle-wait=-1
+
+--
+-- Hot standby check
+--
+\! pg_repack --dbname=contrib_regression --table=tbl_unlogged --standby="dbname=contrib_regression"
+\! pg_repack --dbname=contrib_regression --table=tbl_unlogged --standby-wait=-1
+\! pg_repack --dbname=contrib_regression --table=tbl_unlogged --copy-from-standby
+
+--
+-- Log limits check
+--
+\! pg_repack --dbname=contrib_regression --table=tbl_unlogged --max-log-rows=100000 --log-backpressure=10
+\! pg_repack --dbname=contrib_regression --table=tbl_unlogged --max-log-rows=-1
+\! pg_repack --dbname=contrib_regression --table=tbl_unlogged --log-backpressure=10
+\! pg_repack --dbname=contrib_regression --table=tbl_unlogged --max-log-size=100 --log-backpressure=10
+
+--
+-- Compaction check
+--
+CREATE TABLE tbl_compact (id integer PRIMARY KEY, data text);
+INSERT INTO tbl_compact SELECT i, repeat('x', 100) FROM generate_series(1, 10000) i;
+DELETE FROM tbl_compact WHERE id <= 9000;
+\! pg_repack --dbname=contrib_regression --table=tbl_compact --compact
+SELECT count(*), sum(id) FROM tbl_compact;
+SELECT pg_relation_size('tbl_compact') < 8192 * 50 AS compacted;
+-- the no-op updates can't assign an identity column that is GENERATED ALWAYS
+CREATE TABLE tbl_compact_identity (id integer GENERATED ALWAYS AS IDENTITY PRIMARY KEY, data text);
+INSERT INTO tbl_compact_identity (data) SELECT repeat('x', 100) FROM generate_series(1, 10000);
+DELETE FROM tbl_compact_identity WHERE id <= 9000;
+\! pg_repack --dbname=contrib_regression --table=tbl_compact_identity --compact
+SELECT count(*), sum(id) FROM tbl_compact_identity;
+SELECT pg_relation_size('tbl_compact_identity') < 8192 * 50 AS compacted;
+CREATE TABLE tbl_compact_identity_only (id integer GENERATED ALWAYS AS IDENTITY PRIMARY KEY);
+INSERT INTO tbl_compact_identity_only SELECT FROM generate_series(1, 100);
+\! pg_repack --dbname=contrib_regression --table=tbl_compact_identity_only --compact
+
+--
+-- Background worker check
+--
+SELECT repack.start('tbl_compact', '--bogus');
+SELECT repack.start('tbl_compact', '--no-order') > 0 AS started;
+\! for i in $(seq 600); do psql -d contrib_regression -Atc "SELECT count(*) FROM repack.jobs WHERE phase NOT IN ('done', 'failed')" | grep -qx 0 && break; sleep 0.1; done
+SELECT relation, phase, error FROM repack.job_status;
+SELECT count(*), sum(id) FROM tbl_compact;
+-- a job whose worker is gone, the pid being reused by this backend
+INSERT INTO repack.jobs (relid, options, phase, pid, phase_started)
+  VALUES ('tbl_compact'::regclass, '{}', 'apply', pg_backend_pid(), now() - interval '1 day');
+SELECT relation, phase FROM repack.job_status ORDER BY id;
+DELETE FROM repack.jobs;
+
 
 --
 -- partitioned table check
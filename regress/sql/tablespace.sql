@@ -171,3 +171,36 @@ SELECT relname, spcname
 FROM pg_class JOIN pg_tablespace ts ON ts.oid = reltablespace
 WHERE relname ~ '^testts1'
 ORDER BY relname;
+
+--move the indexes matching a pattern, the first matching pattern applies
+\! pg_repack --dbname=contrib_regression --table=testts1 --index-tablespace=%pkey=testts --index-tablespace=%=pg_default --index-fillfactor=70
+
+SELECT relname, spcname
+FROM pg_class JOIN pg_tablespace ts ON ts.oid = reltablespace
+WHERE relname ~ '^testts1'
+ORDER BY relname;
+
+SELECT relname, reloptions
+FROM pg_class
+WHERE relname ~ '^testts1_'
+ORDER BY relname;
+
+--the same with --index
+\! pg_repack --dbname=contrib_regression --index=testts1_with_idx --index-tablespace=%_idx=testts --index-fillfactor=90
+
+SELECT relname, spcname
+FROM pg_class JOIN pg_tablespace ts ON ts.oid = reltablespace
+WHERE relname ~ '^testts1'
+ORDER BY relname;
+
+SELECT relname, reloptions
+FROM pg_class
+WHERE relname ~ '^testts1_'
+ORDER BY relname;
+
+--invalid mapping
+\! pg_repack --dbname=contrib_regression --table=testts1 --index-tablespace=testts
+
+--scratch objects in another tablespace
+\! pg_repack --dbname=contrib_regression --table=testts1 --log-tablespace=testts --sort-tablespace=testts
+\! pg_repack --dbname=contrib_regression --table=testts1 --sort-tablespace=nosuch
@@ -19,3 +19,39 @@ INSERT INTO trigger_t1 VALUES (111, 222);
 UPDATE trigger_t1 SET a=333, b=444 WHERE a = 111;
 DELETE FROM trigger_t1 WHERE a = 333;
 SELECT * FROM repack.log_:t1_oid;
+
+--
+-- repack.repack_coalesce_trigger tests
+--
+
+CREATE TABLE trigger_t2 (a int PRIMARY KEY, b int);
+INSERT INTO trigger_t2 VALUES (3, 30), (4, 40);
+
+SELECT oid AS t2_oid FROM pg_catalog.pg_class WHERE relname = 'trigger_t2'
+\gset
+
+CREATE TYPE repack.pk_:t2_oid AS (a integer);
+CREATE TABLE repack.log_:t2_oid (id bigserial PRIMARY KEY, pk repack.pk_:t2_oid, row public.trigger_t2);
+CREATE TRIGGER repack_trigger AFTER INSERT OR DELETE OR UPDATE ON trigger_t2
+    FOR EACH ROW EXECUTE PROCEDURE repack.repack_coalesce_trigger('a');
+
+BEGIN;
+INSERT INTO trigger_t2 VALUES (1, 10);
+UPDATE trigger_t2 SET b = 11 WHERE a = 1;
+UPDATE trigger_t2 SET b = 12 WHERE a = 1;
+UPDATE trigger_t2 SET b = 31 WHERE a = 3;
+UPDATE trigger_t2 SET b = 32 WHERE a = 3;
+DELETE FROM trigger_t2 WHERE a = 4;
+INSERT INTO trigger_t2 VALUES (2, 20);
+DELETE FROM trigger_t2 WHERE a = 2;
+SAVEPOINT s1;
+UPDATE trigger_t2 SET b = 33 WHERE a = 3;
+INSERT INTO trigger_t2 VALUES (5, 50);
+ROLLBACK TO SAVEPOINT s1;
+SAVEPOINT s2;
+INSERT INTO trigger_t2 VALUES (6, 60);
+RELEASE SAVEPOINT s2;
+RELEASE SAVEPOINT s1;
+SELECT count(*) FROM repack.log_:t2_oid;
+COMMIT;
+SELECT pk, row FROM repack.log_:t2_oid ORDER BY pk, row;
@@ -0,0 +1,145 @@
+#
+# pg_repack: regress/t/001_capture.pl
+#
+# Capture of the changes in shared memory, which needs pg_repack in
+# shared_preload_libraries and so a server of its own: the changes of
+# aborted subtransactions are dropped, the changes visible to the snapshot
+# of the copy are skipped, and a full ring spills into the log table
+# without reordering the changes, even for an apply before the drain.
+#
+
+use strict;
+use warnings;
+use Test::More;
+
+my $node;
+if (eval { require PostgreSQL::Test::Cluster; 1 })
+{
+	$node = PostgreSQL::Test::Cluster->new('capture');
+}
+else
+{
+	# before PostgreSQL 15
+	require PostgresNode;
+	$node = PostgresNode::get_new_node('capture');
+}
+
+$node->init;
+# 8 kB per table, for records of up to 2 kB
+$node->append_conf('postgresql.conf', qq{
+shared_preload_libraries = 'pg_repack'
+pg_repack.capture_memory = 64kB
+});
+$node->start;
+
+$node->safe_psql('postgres', q{
+CREATE EXTENSION pg_repack;
+CREATE TABLE tbl (id integer PRIMARY KEY, val text);
+DO $$
+DECLARE
+    t record;
+BEGIN
+    SELECT * INTO t FROM repack.tables WHERE relid = 'tbl'::regclass;
+    EXECUTE t.create_pktype;
+    EXECUTE t.create_log;
+    EXECUTE t.create_trigger;
+    EXECUTE t.enable_trigger;
+END
+$$;
+});
+my $oid = $node->safe_psql('postgres', q{SELECT 'tbl'::regclass::oid});
+my $log = "repack.log_$oid";
+
+is($node->safe_psql('postgres', "SELECT repack.capture_start($oid)"),
+	't', 'capture started');
+
+# aborted subtransaction
+$node->safe_psql('postgres', q{
+BEGIN;
+INSERT INTO tbl VALUES (1, 'a');
+SAVEPOINT s;
+INSERT INTO tbl VALUES (2, 'b');
+ROLLBACK TO s;
+INSERT INTO tbl VALUES (3, 'c');
+COMMIT;
+});
+is($node->safe_psql('postgres', "SELECT count(*) FROM $log"),
+	'0', 'changes captured in shared memory');
+is($node->safe_psql('postgres', "SELECT repack.capture_drain($oid)"),
+	'2', 'committed changes drained');
+is($node->safe_psql('postgres',
+		"SELECT string_agg((l.\"row\").id::text, ',' ORDER BY l.id) FROM $log l"),
+	'1,3', 'change of the aborted subtransaction dropped');
+
+# drain of the copy, which already sees the committed changes
+$node->safe_psql('postgres', q{INSERT INTO tbl VALUES (4, 'd')});
+is($node->safe_psql('postgres', qq{
+BEGIN ISOLATION LEVEL REPEATABLE READ;
+SELECT repack.capture_drain($oid, true);
+COMMIT;
+}), '0', 'changes visible to the copy skipped');
+$node->safe_psql('postgres', q{INSERT INTO tbl VALUES (5, 'e')});
+is($node->safe_psql('postgres', "SELECT repack.capture_drain($oid)"),
+	'1', 'changes after the copy drained');
+is($node->safe_psql('postgres',
+		"SELECT string_agg((l.\"row\").id::text, ',' ORDER BY l.id) FROM $log l"),
+	'1,3,5', 'only the changes after the copy logged');
+
+# spill of a full ring into the log table
+$node->safe_psql('postgres',
+	q{INSERT INTO tbl SELECT i, repeat('x', 100) FROM generate_series(6, 505) i});
+is($node->safe_psql('postgres',
+		"SELECT count(*) > 0 FROM $log l WHERE (l.\"row\").id > 5"),
+	't', 'full ring spilled into the log table');
+$node->safe_psql('postgres', "SELECT repack.capture_drain($oid)");
+is($node->safe_psql('postgres', qq{
+SELECT count(*), array_agg((l."row").id ORDER BY l.id) =
+                 array_agg((l."row").id ORDER BY (l."row").id)
+  FROM $log l WHERE (l."row").id > 5
+}), '500|t', 'spilled and captured changes logged in order');
+
+# apply between a spill and the drain of the change it depends on
+$node->safe_psql('postgres', q{
+CREATE TABLE tbl2 (id integer PRIMARY KEY, val text);
+DO $$
+DECLARE
+    t record;
+BEGIN
+    SELECT * INTO t FROM repack.tables WHERE relid = 'tbl2'::regclass;
+    EXECUTE t.create_pktype;
+    EXECUTE t.create_log;
+    EXECUTE t.create_trigger;
+    EXECUTE t.enable_trigger;
+    EXECUTE t.create_table USING t.relid, 'pg_default'::name;
+END
+$$;
+});
+my $oid2 = $node->safe_psql('postgres', q{SELECT 'tbl2'::regclass::oid});
+my $apply = qq{
+SELECT repack.repack_apply(sql_peek::cstring, sql_insert::cstring,
+                           sql_delete::cstring, sql_update::cstring,
+                           sql_pop::cstring, 0)
+  FROM repack.tables WHERE relid = $oid2
+};
+
+is($node->safe_psql('postgres', "SELECT repack.capture_start($oid2)"),
+	't', 'capture of the second table started');
+$node->safe_psql('postgres', q{INSERT INTO tbl2 VALUES (1, 'a')});
+# a row of 3200 bytes that don't compress, too long for the ring
+$node->safe_psql('postgres', q{
+UPDATE tbl2 SET val = (SELECT string_agg(md5(i::text), '')
+                         FROM generate_series(1, 100) i)
+ WHERE id = 1
+});
+is($node->safe_psql('postgres', "SELECT count(*) FROM repack.log_$oid2"),
+	'1', 'update spilled into the log table');
+is($node->safe_psql('postgres', $apply),
+	'0', 'update held back behind the insert left in the ring');
+is($node->safe_psql('postgres', "SELECT repack.capture_drain($oid2)"),
+	'1', 'insert drained');
+is($node->safe_psql('postgres', $apply), '2', 'insert and update applied');
+is($node->safe_psql('postgres', "SELECT length(val) FROM repack.table_$oid2"),
+	'3200', 'update applied after the insert');
+
+$node->stop;
+done_testing();